@@ -0,0 +1,290 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Micro-benchmark of the JSON-RPC overhead: getwork calls against a local
+ * stub server, over one json_rpc_req kept for all the calls and over a new
+ * one for every call. Reported per call are the time, the allocations of
+ * libcurl, and the reads of the server, which are about the sends of the
+ * client as the stub answers every request at once.
+ *
+ * usage: bench-rpc [calls]
+ */
+
+#include "cpuminer-config.h"
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <jansson.h>
+#include <curl/curl.h>
+#include "compat.h"
+#include "miner.h"
+
+#define BENCH_CALLS	2000
+#define STUB_BUFSIZE	4096
+
+/* what util.c and scrypt.c take from cpu-miner.c */
+bool opt_debug;
+bool opt_protocol;
+bool want_longpoll;
+bool have_longpoll;
+bool use_syslog;
+int opt_scantime = 5;
+int opt_lookup_gap = 1;
+int longpoll_thr_id = -1;
+struct thr_info *thr_info;
+struct work_restart *work_restart;
+pthread_mutex_t time_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *rpc_req =
+	"{\"method\": \"getwork\", \"params\": [], \"id\":0}\r\n";
+
+static char stub_reply[STUB_BUFSIZE];
+static int stub_reply_len;
+
+static pthread_mutex_t stub_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long stub_conns, stub_reads;	/* stub_lock */
+
+static unsigned long curl_allocs;	/* only the main thread runs curl */
+
+static void *count_malloc(size_t size)
+{
+	curl_allocs++;
+	return malloc(size);
+}
+
+static void *count_realloc(void *ptr, size_t size)
+{
+	curl_allocs++;
+	return realloc(ptr, size);
+}
+
+static char *count_strdup(const char *str)
+{
+	curl_allocs++;
+	return strdup(str);
+}
+
+static void *count_calloc(size_t nmemb, size_t size)
+{
+	curl_allocs++;
+	return calloc(nmemb, size);
+}
+
+static void stub_reply_init(void)
+{
+	char body[1024];
+	int len;
+
+	len = sprintf(body, "{\"result\": {\"data\": \"%0256d\", "
+		      "\"target\": \"%064d\"}, \"error\": null, \"id\": 0}",
+		      0, 0);
+	stub_reply_len = sprintf(stub_reply,
+		"HTTP/1.1 200 OK\r\n"
+		"Content-Type: application/json\r\n"
+		"Content-Length: %d\r\n"
+		"\r\n%s", len, body);
+}
+
+/* answer the requests of a connection, until the client closes it */
+static void *stub_conn_thread(void *userdata)
+{
+	int fd = (int)(intptr_t) userdata;
+	char buf[STUB_BUFSIZE + 1];
+	size_t len = 0;
+	ssize_t n;
+
+	while ((n = recv(fd, buf + len, STUB_BUFSIZE - len, 0)) > 0) {
+		char *hdr_end, *cl;
+		size_t req_len;
+
+		pthread_mutex_lock(&stub_lock);
+		stub_reads++;
+		pthread_mutex_unlock(&stub_lock);
+
+		len += n;
+		buf[len] = '\0';
+		while ((hdr_end = strstr(buf, "\r\n\r\n"))) {
+			req_len = hdr_end + 4 - buf;
+			cl = strcasestr(buf, "\r\nContent-Length:");
+			if (cl && cl < hdr_end)
+				req_len += strtoul(cl + 17, NULL, 10);
+			if (req_len > len)
+				break;
+
+			if (send(fd, stub_reply, stub_reply_len, 0) !=
+			    stub_reply_len)
+				goto out;
+			memmove(buf, buf + req_len, len - req_len + 1);
+			len -= req_len;
+		}
+		if (len == STUB_BUFSIZE)
+			break;
+	}
+
+out:
+	close(fd);
+	return NULL;
+}
+
+static void *stub_thread(void *userdata)
+{
+	int listen_fd = (int)(intptr_t) userdata;
+	pthread_t thr;
+	int fd;
+
+	while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+		pthread_mutex_lock(&stub_lock);
+		stub_conns++;
+		pthread_mutex_unlock(&stub_lock);
+
+		if (pthread_create(&thr, NULL, stub_conn_thread,
+				   (void *)(intptr_t) fd)) {
+			close(fd);
+			continue;
+		}
+		pthread_detach(thr);
+	}
+
+	return NULL;
+}
+
+/* a listener on a free port of the loopback, 0 on failure */
+static int stub_start(void)
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	pthread_t thr;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return 0;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+	    listen(fd, 16) ||
+	    getsockname(fd, (struct sockaddr *) &addr, &addrlen) ||
+	    pthread_create(&thr, NULL, stub_thread, (void *)(intptr_t) fd)) {
+		close(fd);
+		return 0;
+	}
+	pthread_detach(thr);
+
+	return ntohs(addr.sin_port);
+}
+
+static bool bench_call(struct json_rpc_req *req)
+{
+	json_t *val;
+
+	val = json_rpc_call(req, rpc_req, false, false, NULL);
+	if (!val)
+		return false;
+	json_decref(val);
+	return true;
+}
+
+static bool bench_run(const char *name, const char *url, int calls,
+		      bool pooled)
+{
+	struct json_rpc_req *req = NULL;
+	struct timeval tv_start, tv_end, diff;
+	unsigned long conns, reads;
+	double usecs;
+	bool rc = true;
+	int i;
+
+	pthread_mutex_lock(&stub_lock);
+	stub_conns = stub_reads = 0;
+	pthread_mutex_unlock(&stub_lock);
+	curl_allocs = 0;
+
+	gettimeofday(&tv_start, NULL);
+	for (i = 0; i < calls && rc; i++) {
+		if (!req)
+			req = json_rpc_req_new(url, "user:pass");
+		rc = req && bench_call(req);
+		if (!pooled && req) {
+			json_rpc_req_free(req);
+			req = NULL;
+		}
+	}
+	if (req)
+		json_rpc_req_free(req);
+	gettimeofday(&tv_end, NULL);
+
+	if (!rc) {
+		fprintf(stderr, "%s: call %d failed\n", name, i);
+		return false;
+	}
+
+	timeval_subtract(&diff, &tv_end, &tv_start);
+	usecs = diff.tv_sec * 1e6 + diff.tv_usec;
+
+	pthread_mutex_lock(&stub_lock);
+	conns = stub_conns;
+	reads = stub_reads;
+	pthread_mutex_unlock(&stub_lock);
+
+	printf("%-10s %10.1f %12.1f %12lu %12.2f\n", name, usecs / calls,
+	       (double) curl_allocs / calls, conns, (double) reads / calls);
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	char url[64];
+	int calls = BENCH_CALLS;
+	int port;
+
+	if (argc > 1)
+		calls = atoi(argv[1]);
+	if (calls <= 0) {
+		fprintf(stderr, "usage: %s [calls]\n", argv[0]);
+		return 1;
+	}
+
+	if (curl_global_init_mem(CURL_GLOBAL_ALL, count_malloc, free,
+				 count_realloc, count_strdup, count_calloc)) {
+		fprintf(stderr, "curl initialization failed\n");
+		return 1;
+	}
+
+	stub_reply_init();
+	port = stub_start();
+	if (!port) {
+		fprintf(stderr, "stub server failed to start\n");
+		return 1;
+	}
+	sprintf(url, "http://127.0.0.1:%d/", port);
+
+	printf("%d getwork calls against %s\n", calls, url);
+	printf("%-10s %10s %12s %12s %12s\n", "requests", "usecs/call",
+	       "allocs/call", "connections", "reads/call");
+
+	/* warm up the resolver and the allocator */
+	if (!bench_run("warm-up", url, calls / 10 + 1, true) ||
+	    !bench_run("pooled", url, calls, true) ||
+	    !bench_run("per-call", url, calls, false))
+		return 1;
+
+	curl_global_cleanup();
+	return 0;
+}
@@ -0,0 +1,161 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Benchmark of the padding between the V regions of the lanes of a scrypt
+ * kernel, SCRYPT_LANE_COLOR, which is fixed at build time: this is built
+ * once for every value, as bench-scrypt-color0 to bench-scrypt-color2.
+ * Every kernel is run for a while on one thread, and the hash rate is
+ * reported with the L1 data cache misses per hash when the kernel has
+ * perf events for them. Conflict misses between the lanes show up as more
+ * misses and a lower hash rate than with the other colors.
+ *
+ * usage: bench-scrypt-colorN [seconds per kernel] [lookup gap]
+ */
+
+#include "cpuminer-config.h"
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <pthread.h>
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+#include <jansson.h>
+#include <curl/curl.h>
+#include "compat.h"
+#include "miner.h"
+
+/* what util.c and scrypt.c take from cpu-miner.c */
+bool opt_debug;
+bool opt_protocol;
+bool want_longpoll;
+bool have_longpoll;
+bool use_syslog;
+int opt_scantime = 5;
+int opt_lookup_gap = 1;
+int longpoll_thr_id = -1;
+struct thr_info *thr_info;
+struct work_restart *work_restart;
+pthread_mutex_t time_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct work_restart bench_restart[1];
+
+/* a counter of the L1 data cache read misses of this thread, or -1 */
+static int l1d_misses_open(void)
+{
+#ifdef HAVE_LINUX_PERF_EVENT_H
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = PERF_COUNT_HW_CACHE_L1D |
+		      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+	return -1;
+#endif
+}
+
+static bool l1d_misses_read(int fd, uint64_t *count)
+{
+	return fd >= 0 && read(fd, count, sizeof(*count)) == sizeof(*count);
+}
+
+static bool bench_impl(const struct scrypt_impl *impl, int msecs, int fd)
+{
+	unsigned char data[128] __attribute__((aligned(128))) = { };
+	unsigned char target[32] = { };
+	struct scratchbuf sb;
+	unsigned long hashes_done, total = 0;
+	struct timeval tv_start, tv_end, diff;
+	uint64_t misses_start, misses_end;
+	bool misses;
+	int diffms;
+
+	/* huge pages make the aliasing of the lanes the same on every run */
+	if (!scratchbuf_alloc(&sb,
+			      SCRYPT_SCRATCHBUF_SIZE(impl->lanes, opt_lookup_gap),
+			      true, false))
+		return false;
+
+	/* the first run warms up the caches and is not counted */
+	scrypt_impl_scanhash(impl, 0, data, sb.buf, target, impl->lanes,
+			     &hashes_done);
+
+	misses = l1d_misses_read(fd, &misses_start);
+	gettimeofday(&tv_start, NULL);
+	do {
+		scrypt_impl_scanhash(impl, 0, data, sb.buf, target,
+				     impl->lanes * 16, &hashes_done);
+		total += hashes_done;
+
+		gettimeofday(&tv_end, NULL);
+		timeval_subtract(&diff, &tv_end, &tv_start);
+		diffms = diff.tv_sec * 1000 + diff.tv_usec / 1000;
+	} while (diffms < msecs);
+	misses = misses && l1d_misses_read(fd, &misses_end);
+
+	printf("%-22s %5d %12.2f", impl->name, impl->lanes,
+	       total / (double)diffms);
+	if (misses)
+		printf(" %16.1f\n", (misses_end - misses_start) /
+				    (double)total);
+	else
+		printf(" %16s\n", "-");
+
+	scratchbuf_free(&sb);
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	const struct scrypt_impl *impl;
+	int msecs = 3000;
+	int fd;
+
+	if (argc > 1)
+		msecs = atof(argv[1]) * 1000;
+	if (argc > 2)
+		opt_lookup_gap = atoi(argv[2]);
+	if (msecs <= 0 || opt_lookup_gap < 1 ||
+	    opt_lookup_gap > SCRYPT_MAX_LOOKUP_GAP) {
+		fprintf(stderr, "usage: %s [seconds per kernel] "
+			"[lookup gap]\n", argv[0]);
+		return 1;
+	}
+
+	work_restart = bench_restart;
+	fd = l1d_misses_open();
+
+	printf("lane color %d, lookup gap %d\n", SCRYPT_LANE_COLOR,
+	       opt_lookup_gap);
+	printf("%-22s %5s %12s %16s\n", "kernel", "lanes", "khash/sec",
+	       "L1D misses/hash");
+	for (impl = scrypt_impls; impl->name; impl++)
+		if (!bench_impl(impl, msecs, fd)) {
+			fprintf(stderr, "%s: scratchpad allocation failed\n",
+				impl->name);
+			return 1;
+		}
+
+	if (fd >= 0)
+		close(fd);
+	return 0;
+}
@@ -435,17 +435,14 @@ static int lex_scan_number(lex_t *lex, char c, json_error_t *error)
         lex_unget_unsave(lex, c);
 
         saved_text = strbuffer_value(&lex->saved_text);
+        errno = 0;
         value = strtol(saved_text, &end, 10);
         assert(end == saved_text + lex->saved_text.length);
 
-        if((value == LONG_MAX && errno == ERANGE) || value > INT_MAX) {
-            error_set(error, lex, "too big integer");
-            goto out;
-        }
-        else if((value == LONG_MIN && errno == ERANGE) || value < INT_MIN) {
-            error_set(error, lex, "too big negative integer");
-            goto out;
-        }
+        /* integers are ints, bigger ones (e.g. amounts in satoshis)
+           are kept as reals */
+        if(errno == ERANGE || value > INT_MAX || value < INT_MIN)
+            goto real;
 
         lex->token = TOKEN_INTEGER;
         lex->value.integer = (int)value;
@@ -480,7 +477,9 @@ static int lex_scan_number(lex_t *lex, char c, json_error_t *error)
 
     lex_unget_unsave(lex, c);
 
+real:
     saved_text = strbuffer_value(&lex->saved_text);
+    errno = 0;
     value = strtod(saved_text, &end);
     assert(end == saved_text + lex->saved_text.length);
 
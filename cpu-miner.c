@@ -25,8 +25,12 @@
 #include <getopt.h>
 #include <jansson.h>
 #include <curl/curl.h>
+#ifdef HAVE_LIBNUMA
+#include <numa.h>
+#endif
 #include "compat.h"
 #include "miner.h"
+#include "elist.h"
 
 #define PROGRAM_NAME		"minerd"
 #define DEF_RPC_URL		"http://127.0.0.1:8332/"
@@ -66,6 +70,63 @@ static inline void affine_to_cpu(int id, int cpu)
 {
 }
 #endif
+
+#ifdef HAVE_LIBNUMA
+static int *numa_nodes;	/* the nodes which have CPUs */
+static int num_numa_nodes;
+
+static void numa_init(void)
+{
+	struct bitmask *cpus;
+	int node;
+
+	if (numa_available() < 0)
+		return;
+	numa_nodes = calloc(numa_max_node() + 1, sizeof(*numa_nodes));
+	cpus = numa_allocate_cpumask();
+	if (!numa_nodes || !cpus)
+		return;
+	for (node = 0; node <= numa_max_node(); node++) {
+		if (!numa_node_to_cpus(node, cpus) &&
+		    numa_bitmask_weight(cpus) > 0)
+			numa_nodes[num_numa_nodes++] = node;
+	}
+	numa_free_cpumask(cpus);
+}
+
+/*
+ * Keep the thread on one NUMA node and make its memory come from there.
+ * Threads bound to a CPU stay on the node of that CPU, the rest are spread
+ * over the nodes round robin. Returns the node or -1.
+ */
+static int numa_bind_thread(int id, int cpu)
+{
+	int node;
+
+	if (num_numa_nodes < 2)
+		return -1;
+
+	if (cpu >= 0)
+		node = numa_node_of_cpu(cpu);
+	else {
+		node = numa_nodes[id % num_numa_nodes];
+		if (numa_run_on_node(node))
+			return -1;
+	}
+	numa_set_preferred(node);
+	applog(LOG_INFO, "Binding thread %d to NUMA node %d", id, node);
+	return node;
+}
+#else
+static inline void numa_init(void)
+{
+}
+
+static inline int numa_bind_thread(int id, int cpu)
+{
+	return -1;
+}
+#endif
 		
 enum workio_commands {
 	WC_GET_WORK,
@@ -78,6 +139,16 @@ struct workio_cmd {
 	union {
 		struct work	*work;
 	} u;
+
+	struct list_head	list;		/* in the workio thread */
+	CURL			*curl;		/* while in flight */
+	struct json_rpc_req	*req;		/* its connection */
+	char			*rpc_req;	/* WC_SUBMIT_WORK request */
+	int			failures;
+	time_t			retry_at;	/* when to send it again */
+
+	/* WC_SUBMIT_WORK */
+	struct timeval		tv_found;
 };
 
 enum sha256_algos {
@@ -92,25 +163,47 @@ bool opt_debug = false;
 bool opt_protocol = false;
 bool want_longpoll = true;
 bool have_longpoll = false;
+bool have_stratum = false;
 bool use_syslog = false;
 static bool opt_quiet = false;
 static int opt_retries = 10;
 static int opt_fail_pause = 30;
+static int opt_timeout = 60;
 int opt_scantime = 5;
 static json_t *opt_config;
 static const bool opt_time = true;
 static enum sha256_algos opt_algo = ALGO_SCRYPT;
 static int opt_n_threads;
+static int opt_queue = 1;
+static bool opt_autotune = true;
+int opt_lookup_gap = 1;
+static bool opt_lookup_gap_set = false;
+static unsigned long opt_max_memory; /* KiB per thread, 0 if unlimited */
+static bool opt_huge_pages = true;
+static bool opt_lock_memory = false;
+static bool opt_numa = true;
+static bool opt_sha_ni = true;
 static int num_processors;
 static int num_cell_spu; /* the number of SPU cores for Cell/BE (normally 6) */
 static char *rpc_url;
 static char *rpc_userpass;
 static char *rpc_user, *rpc_pass;
+static bool have_gbt = false;
+static char *opt_coinbase_addr;
+static unsigned char gbt_pk_script[64];	/* pays to --coinbase-addr */
+static size_t gbt_pk_script_size;
 struct thr_info *thr_info;
 static int work_thr_id;
 int longpoll_thr_id;
+int stratum_thr_id = -1;
+static struct stratum_ctx stratum = {
+	.sock_lock	= PTHREAD_MUTEX_INITIALIZER,
+	.work_lock	= PTHREAD_MUTEX_INITIALIZER,
+};
 struct work_restart *work_restart = NULL;
 pthread_mutex_t time_lock;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static double *thr_hashrates;	/* khash/sec of each thread */
 
 
 struct option_help {
@@ -130,18 +223,53 @@ static struct option_help options_help[] = {
 	  "(-a XXX) USE *ONLY* scrypt (e.g. --algo scrypt) WITH TENEBRIX\n" 
 	  "\tscrypt is the default now" },
 
+	{ "coinbase-addr ADDR",
+	  "Mine solo with getblocktemplate instead of getwork and pay\n"
+	  "\tthe blocks to ADDR (default: getwork)" },
+
 	{ "quiet",
 	  "(-q) Disable per-thread hashmeter output (default: off)" },
 
 	{ "debug",
 	  "(-D) Enable debug output (default: off)" },
 
+	{ "kernel NAME",
+	  "Use the given scrypt kernel instead of benchmarking all\n"
+	  "\tof them at startup (default: auto)" },
+
+	{ "lookup-gap N",
+	  "Store only every Nth scrypt scratchpad entry and recompute\n"
+	  "\tthe rest, trading time for memory (default: 1)" },
+
+	{ "max-memory N",
+	  "Limit the scrypt scratchpad size to N KiB per thread, the\n"
+	  "\tlookup gap is then chosen automatically (default: none)" },
+
+	{ "lock-memory",
+	  "Lock the scrypt scratchpads in memory (default: off)" },
+
+	{ "no-huge-pages",
+	  "Do not use huge pages for the scrypt scratchpads\n"
+	  "\t(default: use them if available)" },
+
 	{ "no-longpoll",
 	  "Disable X-Long-Polling support (default: enabled)" },
 
+	{ "no-numa",
+	  "Do not bind the miner threads and their memory to NUMA\n"
+	  "\tnodes (default: bind when having several nodes)" },
+
+	{ "no-sha-ni",
+	  "Do not use the x86 SHA extensions for SHA-256\n"
+	  "\t(default: use them if available and faster)" },
+
 	{ "protocol-dump",
 	  "(-P) Verbose dump of protocol-level activities (default: off)" },
 
+	{ "queue N",
+	  "Number of work units to fetch ahead of time, 0 to fetch\n"
+	  "\tthem only when needed (default: 1)" },
+
 	{ "retries N",
 	  "(-r N) Number of times to retry, if JSON-RPC call fails\n"
 	  "\t(default: 10; use -1 for \"never\")" },
@@ -162,9 +290,13 @@ static struct option_help options_help[] = {
 	{ "threads N",
 	  "(-t N) Number of miner threads (default: 1)" },
 
+	{ "timeout N",
+	  "Seconds to wait for a getwork or a share submission\n"
+	  "\tbefore retrying it (default: 60)" },
+
 	{ "url URL",
-	  "URL for bitcoin JSON-RPC server "
-	  "(default: " DEF_RPC_URL ")" },
+	  "URL for bitcoin JSON-RPC server, or stratum+tcp://HOST:PORT\n"
+	  "\tfor a Stratum server (default: " DEF_RPC_URL ")" },
 
 	{ "userpass USERNAME:PASSWORD",
 	  "Username:Password pair for bitcoin JSON-RPC server "
@@ -181,14 +313,24 @@ static struct option_help options_help[] = {
 
 static struct option options[] = {
 	{ "algo", 1, NULL, 'a' },
+	{ "coinbase-addr", 1, NULL, 1013 },
 	{ "config", 1, NULL, 'c' },
 	{ "debug", 0, NULL, 'D' },
 	{ "help", 0, NULL, 'h' },
+	{ "kernel", 1, NULL, 1005 },
+	{ "lookup-gap", 1, NULL, 1006 },
+	{ "max-memory", 1, NULL, 1007 },
+	{ "lock-memory", 0, NULL, 1009 },
+	{ "no-huge-pages", 0, NULL, 1008 },
 	{ "no-longpoll", 0, NULL, 1003 },
+	{ "no-numa", 0, NULL, 1010 },
+	{ "no-sha-ni", 0, NULL, 1011 },
 	{ "pass", 1, NULL, 'p' },
 	{ "protocol-dump", 0, NULL, 'P' },
+	{ "queue", 1, NULL, 1012 },
 	{ "quiet", 0, NULL, 'q' },
 	{ "threads", 1, NULL, 't' },
+	{ "timeout", 1, NULL, 1014 },
 	{ "retries", 1, NULL, 'r' },
 	{ "retry-pause", 1, NULL, 'R' },
 	{ "scantime", 1, NULL, 's' },
@@ -209,8 +351,69 @@ struct work {
 	unsigned char	target[32];
 
 	unsigned char	hash[32];
+
+	unsigned int	gen;		/* work_gen when it was requested */
+	time_t		roll_until;	/* ntime may be rolled until, or 0 */
+
+	/* Stratum work, job_id is the template id for getblocktemplate */
+	char		job_id[128];
+	size_t		xnonce2_len;
+	unsigned char	xnonce2[16];
 };
 
+/*
+ * The miner threads share one upstream work unit and each takes its own
+ * range of nonces from it, so the pool sees one getwork per scantime
+ * rather than one per thread.
+ */
+#define WORK_MAX_NONCE	0xfffffffaU
+
+static struct work g_work;
+static time_t g_work_time;	/* when g_work was fetched, 0 if stale */
+static uint32_t g_work_nonce;	/* the last nonce handed out */
+static pthread_mutex_t g_work_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Work units are fetched ahead of time into work_q, so that taking a new
+ * one does not wait for a getwork round trip. Units requested before the
+ * last new block are stale and dropped.
+ */
+static struct thread_q *work_q;
+static int work_q_pending;	/* queued or being fetched, g_work_lock */
+static int work_q_ready;	/* queued, stats_lock */
+static volatile unsigned int work_gen;	/* bumped on every new block */
+static unsigned long work_waits;
+static double work_wait_total;	/* msecs get_work waited in all */
+
+/*
+ * The workio thread runs all getwork and share requests at once on a curl
+ * multi handle, over up to WORKIO_MAX_CONNS persistent connections, so a
+ * slow reply holds up nothing but itself. Shares get all the connections
+ * but one, which is kept for getwork. Failed shares are retried with a
+ * backoff, up to SUBMIT_MAX_PENDING of them.
+ */
+#define WORKIO_MAX_CONNS	4
+#define WORKIO_POLL_MS		1000
+#define SUBMIT_MAX_PENDING	32
+
+static CURLM *workio_multi;
+static volatile bool workio_quit;
+static struct json_rpc_req *workio_conns[WORKIO_MAX_CONNS];	/* idle */
+static int workio_n_idle, workio_n_conns;
+static int workio_n_submits;	/* shares in flight */
+
+static int submit_q_depth;	/* queued or to be retried, stats_lock */
+static unsigned long submit_count;
+static double submit_time_total;	/* msecs from the find to the server */
+
+static void le32enc_bytes(unsigned char *p, uint32_t x)
+{
+	p[0] = x;
+	p[1] = x >> 8;
+	p[2] = x >> 16;
+	p[3] = x >> 24;
+}
+
 static bool jobj_binary(const json_t *obj, const char *key,
 			void *buf, size_t buflen)
 {
@@ -264,224 +467,1292 @@ err_out:
 	return false;
 }
 
-static bool submit_upstream_work(CURL *curl, const struct work *work)
+/*
+ * getblocktemplate: the coinbase, the merkle root and the header are built
+ * locally, with a new extranonce in the coinbase for every work unit. The
+ * merkle branch of the coinbase is only recomputed when the transactions
+ * change. A few templates are kept, so that a block found on work from the
+ * previous one can still be assembled.
+ */
+#define GBT_XNONCE_SIZE	8
+#define GBT_MAX_TMPLS	4
+
+static const char *gbt_req =
+	"{\"method\": \"getblocktemplate\", \"params\": [{"
+	"\"capabilities\": [\"longpoll\", \"workid\"], "
+	"\"rules\": [\"segwit\", \"mweb\"]}], \"id\":0}\r\n";
+
+struct gbt_tmpl {
+	unsigned int	id;		/* 0 if unused */
+	unsigned char	*coinbase;	/* without the witness */
+	size_t		coinbase_size;
+	size_t		xnonce_offset;
+	bool		witness;	/* the coinbase needs its witness */
+	int		tx_count;	/* without the coinbase */
+	char		*txs_hex;
+	char		*mweb_hex;	/* Litecoin MWEB block, or NULL */
+	char		*workid;
+};
+
+static struct {
+	pthread_mutex_t	lock;
+	struct gbt_tmpl	tmpls[GBT_MAX_TMPLS];
+	struct gbt_tmpl	*cur;
+	unsigned int	last_id;
+
+	/* the header of the current template, in block byte order */
+	unsigned char	version[4];
+	unsigned char	prevhash[32];
+	unsigned char	nbits[4];
+	long		time_offset;	/* curtime minus our clock */
+	unsigned char	target[32];
+
+	int		txid_count;
+	unsigned char	(*txids)[32];
+	int		merkle_count;
+	unsigned char	(*merkle)[32];
+	bool		merkle_valid;
+	uint64_t	xnonce;
+	char		*longpollid;
+} gbt = {
+	.lock		= PTHREAD_MUTEX_INITIALIZER,
+};
+
+static size_t varint_enc(unsigned char *p, uint64_t n)
+{
+	if (n < 0xfd) {
+		p[0] = n;
+		return 1;
+	}
+	if (n <= 0xffff) {
+		p[0] = 0xfd;
+		p[1] = n;
+		p[2] = n >> 8;
+		return 3;
+	}
+	p[0] = 0xfe;
+	le32enc_bytes(p + 1, n);
+	return 5;
+}
+
+/* a minimal script push of n, as BIP 34 wants the block height */
+static size_t script_push_int(unsigned char *p, int n)
 {
-	char *hexstr = NULL;
-	json_t *val, *res;
-	char s[345];
-	bool rc = false;
+	size_t len = 0;
 
-	/* build hex string */
-	hexstr = bin2hex(work->data, sizeof(work->data));
-	if (unlikely(!hexstr)) {
-		applog(LOG_ERR, "submit_upstream_work OOM");
-		goto out;
+	if (n >= 0 && n <= 16) {
+		p[0] = n ? 0x50 + n : 0;	/* OP_n */
+		return 1;
+	}
+	while (n) {
+		p[1 + len++] = n & 0xff;
+		n >>= 8;
 	}
+	if (p[len] & 0x80)
+		p[1 + len++] = 0;
+	p[0] = len;
+	return len + 1;
+}
 
-	/* build JSON-RPC request */
-	sprintf(s,
-	      "{\"method\": \"getwork\", \"params\": [ \"%s\" ], \"id\":1}\r\n",
-		hexstr);
+static bool jobj_hash(const json_t *obj, const char *key, unsigned char *hash)
+{
+	unsigned char buf[32];
+	int i;
 
-	if (opt_debug)
-		applog(LOG_DEBUG, "DBG: sending RPC call: %s", s);
+	if (!jobj_binary(obj, key, buf, sizeof(buf)))
+		return false;
+	for (i = 0; i < 32; i++)
+		hash[i] = buf[31 - i];
+	return true;
+}
 
-	/* issue JSON-RPC request */
-	val = json_rpc_call(curl, rpc_url, rpc_userpass, s, false, false);
-	if (unlikely(!val)) {
-		applog(LOG_ERR, "submit_upstream_work json_rpc_call failed");
-		goto out;
+/* the branch of the coinbase up to the merkle root */
+static bool gbt_merkle_branch(void)
+{
+	unsigned char (*level)[32], (*merkle)[32];
+	int count = gbt.txid_count + 1;
+	int i;
+
+	level = malloc((count + 1) * 32);
+	merkle = realloc(gbt.merkle, count * 32);
+	if (merkle)
+		gbt.merkle = merkle;
+	if (!level || !merkle) {
+		free(level);
+		return false;
+	}
+	memcpy(level + 1, gbt.txids, gbt.txid_count * 32);
+
+	gbt.merkle_count = 0;
+	while (count > 1) {
+		memcpy(gbt.merkle[gbt.merkle_count++], level[1], 32);
+		if (count & 1) {
+			memcpy(level[count], level[count - 1], 32);
+			count++;
+		}
+		for (i = 2; i < count; i += 2)
+			sha256d(level[i / 2], level[i], 64);
+		count /= 2;
+	}
+
+	free(level);
+	return true;
+}
+
+static bool gbt_build_coinbase(struct gbt_tmpl *tmpl, const json_t *val)
+{
+	unsigned char script_sig[16], commit[64];
+	size_t script_sig_size, commit_size = 0, size;
+	const char *commit_hex;
+	uint64_t value;
+	unsigned char *p;
+
+	script_sig_size = script_push_int(script_sig,
+		json_integer_value(json_object_get(val, "height")));
+	script_sig[script_sig_size++] = GBT_XNONCE_SIZE;
+	memset(script_sig + script_sig_size, 0, GBT_XNONCE_SIZE);
+	script_sig_size += GBT_XNONCE_SIZE;
+
+	/* the bundled jansson only has int for integers */
+	value = json_number_value(json_object_get(val, "coinbasevalue"));
+
+	commit_hex = json_string_value(json_object_get(val,
+			"default_witness_commitment"));
+	if (commit_hex) {
+		commit_size = strlen(commit_hex) / 2;
+		if (commit_size > sizeof(commit) ||
+		    !hex2bin(commit, commit_hex, commit_size)) {
+			applog(LOG_ERR, "JSON inval default_witness_commitment");
+			return false;
+		}
+	}
+
+	size = 4 + 1 + 36 + 1 + script_sig_size + 4 + 1 +
+	       8 + 1 + gbt_pk_script_size + 4;
+	if (commit_hex)
+		size += 8 + 1 + commit_size;
+	tmpl->coinbase = p = malloc(size);
+	if (!p)
+		return false;
+
+	le32enc_bytes(p, 1);			/* version */
+	p += 4;
+	*p++ = 1;				/* the input */
+	memset(p, 0, 32);
+	memset(p + 32, 0xff, 4);
+	p += 36;
+	*p++ = script_sig_size;
+	memcpy(p, script_sig, script_sig_size);
+	tmpl->xnonce_offset = p + script_sig_size - GBT_XNONCE_SIZE -
+			      tmpl->coinbase;
+	p += script_sig_size;
+	memset(p, 0xff, 4);			/* sequence */
+	p += 4;
+	*p++ = commit_hex ? 2 : 1;		/* the outputs */
+	le32enc_bytes(p, value);
+	le32enc_bytes(p + 4, value >> 32);
+	p += 8;
+	*p++ = gbt_pk_script_size;
+	memcpy(p, gbt_pk_script, gbt_pk_script_size);
+	p += gbt_pk_script_size;
+	if (commit_hex) {
+		memset(p, 0, 8);
+		p += 8;
+		*p++ = commit_size;
+		memcpy(p, commit, commit_size);
+		p += commit_size;
+	}
+	le32enc_bytes(p, 0);			/* lock time */
+
+	tmpl->coinbase_size = size;
+	tmpl->witness = commit_hex != NULL;
+	return true;
+}
+
+static void gbt_tmpl_free(struct gbt_tmpl *tmpl)
+{
+	free(tmpl->coinbase);
+	free(tmpl->txs_hex);
+	free(tmpl->mweb_hex);
+	free(tmpl->workid);
+	memset(tmpl, 0, sizeof(*tmpl));
+}
+
+static bool str_equal(const char *a, const char *b)
+{
+	return a == b || (a && b && !strcmp(a, b));
+}
+
+/*
+ * Take a block template as the current one. new_block, if given, tells
+ * whether it is on another previous block than the last template.
+ */
+static bool gbt_decode(const json_t *val, bool *new_block)
+{
+	struct gbt_tmpl tmpl = { };
+	unsigned char prevhash[32], target[32], nbits[4];
+	unsigned char (*txids)[32] = NULL;
+	const json_t *txs, *tx;
+	const char *s;
+	size_t txs_len = 0;
+	bool txs_changed;
+	int i, n;
+
+	if (!jobj_hash(val, "previousblockhash", prevhash) ||
+	    !jobj_hash(val, "target", target) ||
+	    !jobj_binary(val, "bits", nbits, sizeof(nbits)) ||
+	    !json_is_integer(json_object_get(val, "curtime")) ||
+	    !json_is_integer(json_object_get(val, "height")) ||
+	    !json_is_number(json_object_get(val, "coinbasevalue"))) {
+		applog(LOG_ERR, "JSON invalid block template");
+		return false;
+	}
+
+	/* the transaction ids, before SegWit the hash is the id */
+	txs = json_object_get(val, "transactions");
+	n = json_array_size(txs);
+	txids = malloc((n ? n : 1) * 32);
+	if (!txids)
+		return false;
+	for (i = 0; i < n; i++) {
+		tx = json_array_get(txs, i);
+		s = json_string_value(json_object_get(tx, "data"));
+		if (!s || !jobj_hash(tx, json_object_get(tx, "txid") ?
+				     "txid" : "hash", txids[i])) {
+			applog(LOG_ERR, "JSON invalid transaction %d", i);
+			goto err_out;
+		}
+		txs_len += strlen(s);
+	}
+
+	tmpl.tx_count = n;
+	tmpl.txs_hex = malloc(txs_len + 1);
+	if (!tmpl.txs_hex)
+		goto err_out;
+	tmpl.txs_hex[0] = '\0';
+	for (i = 0, txs_len = 0; i < n; i++) {
+		s = json_string_value(json_object_get(json_array_get(txs, i),
+						      "data"));
+		strcpy(tmpl.txs_hex + txs_len, s);
+		txs_len += strlen(s);
+	}
+
+	s = json_string_value(json_object_get(val, "mweb"));
+	if (s && !(tmpl.mweb_hex = strdup(s)))
+		goto err_out;
+	s = json_string_value(json_object_get(val, "workid"));
+	if (s && !(tmpl.workid = strdup(s)))
+		goto err_out;
+	if (!gbt_build_coinbase(&tmpl, val))
+		goto err_out;
+
+	pthread_mutex_lock(&gbt.lock);
+
+	txs_changed = n != gbt.txid_count ||
+		      (n && memcmp(txids, gbt.txids, n * 32));
+	if (txs_changed || !gbt.merkle_valid) {
+		free(gbt.txids);
+		gbt.txids = txids;
+		gbt.txid_count = n;
+		txids = NULL;
+		gbt.merkle_valid = gbt_merkle_branch();
+		if (!gbt.merkle_valid) {
+			pthread_mutex_unlock(&gbt.lock);
+			goto err_out;
+		}
+	}
+
+	/* a template that builds the same blocks keeps its id */
+	if (gbt.cur && gbt.cur->xnonce_offset == tmpl.xnonce_offset)
+		memset(gbt.cur->coinbase + tmpl.xnonce_offset, 0,
+		       GBT_XNONCE_SIZE);
+	if (txs_changed || !gbt.cur ||
+	    gbt.cur->coinbase_size != tmpl.coinbase_size ||
+	    memcmp(gbt.cur->coinbase, tmpl.coinbase, tmpl.coinbase_size) ||
+	    !str_equal(gbt.cur->mweb_hex, tmpl.mweb_hex) ||
+	    !str_equal(gbt.cur->workid, tmpl.workid)) {
+		if (!++gbt.last_id)
+			gbt.last_id++;
+		tmpl.id = gbt.last_id;
+		gbt.cur = &gbt.tmpls[tmpl.id % GBT_MAX_TMPLS];
+		gbt_tmpl_free(gbt.cur);
+		*gbt.cur = tmpl;
+		memset(&tmpl, 0, sizeof(tmpl));
+	}
+
+	if (new_block)
+		*new_block = memcmp(prevhash, gbt.prevhash, 32) != 0;
+	le32enc_bytes(gbt.version,
+		      json_integer_value(json_object_get(val, "version")));
+	memcpy(gbt.prevhash, prevhash, 32);
+	for (i = 0; i < 4; i++)
+		gbt.nbits[i] = nbits[3 - i];
+	gbt.time_offset = json_integer_value(json_object_get(val, "curtime")) -
+			  time(NULL);
+	memcpy(gbt.target, target, 32);
+
+	s = json_string_value(json_object_get(val, "longpollid"));
+	free(gbt.longpollid);
+	gbt.longpollid = s ? strdup(s) : NULL;
+
+	pthread_mutex_unlock(&gbt.lock);
+
+	gbt_tmpl_free(&tmpl);
+	free(txids);
+	return true;
+
+err_out:
+	gbt_tmpl_free(&tmpl);
+	free(txids);
+	return false;
+}
+
+/* Build work out of the current template with the next extranonce */
+static bool gbt_gen_work(struct work *work)
+{
+	unsigned char merkle_root[64], header[80];
+	struct gbt_tmpl *tmpl;
+	int i;
+
+	pthread_mutex_lock(&gbt.lock);
+
+	tmpl = gbt.cur;
+	if (!tmpl) {
+		pthread_mutex_unlock(&gbt.lock);
+		return false;
+	}
+
+	memset(work, 0, sizeof(*work));
+	sprintf(work->job_id, "%u", tmpl->id);
+	work->xnonce2_len = GBT_XNONCE_SIZE;
+	gbt.xnonce++;
+	for (i = 0; i < GBT_XNONCE_SIZE; i++)
+		work->xnonce2[i] = gbt.xnonce >> (8 * i);
+	memcpy(tmpl->coinbase + tmpl->xnonce_offset, work->xnonce2,
+	       GBT_XNONCE_SIZE);
+
+	sha256d(merkle_root, tmpl->coinbase, tmpl->coinbase_size);
+	for (i = 0; i < gbt.merkle_count; i++) {
+		memcpy(merkle_root + 32, gbt.merkle[i], 32);
+		sha256d(merkle_root, merkle_root, 64);
+	}
+
+	memcpy(header, gbt.version, 4);
+	memcpy(header + 4, gbt.prevhash, 32);
+	memcpy(header + 36, merkle_root, 32);
+	le32enc_bytes(header + 68, time(NULL) + gbt.time_offset);
+	memcpy(header + 72, gbt.nbits, 4);
+	memset(header + 76, 0, 4);
+
+	/* getwork has every word of the header byte swapped */
+	for (i = 0; i < 80; i++)
+		work->data[i] = header[i ^ 3];
+	le32enc_bytes(work->data + 80, 0x80000000);
+	le32enc_bytes(work->data + 124, 0x00000280);
+	memcpy(work->target, gbt.target, 32);
+
+	pthread_mutex_unlock(&gbt.lock);
+
+	return true;
+}
+
+/* whether the template of work is still kept, so its blocks can be sent */
+static bool gbt_work_kept(const struct work *work)
+{
+	unsigned long id;
+	bool kept;
+
+	if (!have_gbt)
+		return true;
+
+	id = strtoul(work->job_id, NULL, 10);
+	pthread_mutex_lock(&gbt.lock);
+	kept = gbt.tmpls[id % GBT_MAX_TMPLS].id == id;
+	pthread_mutex_unlock(&gbt.lock);
+
+	return kept;
+}
+
+static char *hex_append(char *p, const unsigned char *bin, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+
+	while (len--) {
+		*p++ = hex[*bin >> 4];
+		*p++ = hex[*bin++ & 0xf];
+	}
+	*p = '\0';
+	return p;
+}
+
+/*
+ * The submitblock request of the whole block, work is a share of the block
+ * target. NULL if the block cannot be made.
+ */
+static char *gbt_submit_req(const struct work *work)
+{
+	unsigned char header[80], varint[9];
+	unsigned long id = strtoul(work->job_id, NULL, 10);
+	struct gbt_tmpl *tmpl;
+	const unsigned char *cb;
+	char *req, *p;
+	size_t len;
+	int i;
+
+	pthread_mutex_lock(&gbt.lock);
+
+	tmpl = &gbt.tmpls[id % GBT_MAX_TMPLS];
+	if (tmpl->id != id) {
+		pthread_mutex_unlock(&gbt.lock);
+		applog(LOG_ERR, "Block template %lu is gone, block lost", id);
+		return NULL;
+	}
+
+	len = 256 + 2 * (80 + sizeof(varint) + tmpl->coinbase_size + 38) +
+	      strlen(tmpl->txs_hex);
+	if (tmpl->mweb_hex)
+		len += 2 + strlen(tmpl->mweb_hex);
+	if (tmpl->workid)
+		len += strlen(tmpl->workid);
+	req = malloc(len);
+	if (!req) {
+		pthread_mutex_unlock(&gbt.lock);
+		applog(LOG_ERR, "gbt_submit_req OOM, block lost");
+		return NULL;
 	}
 
-	res = json_object_get(val, "result");
+	for (i = 0; i < 80; i++)
+		header[i] = work->data[i ^ 3];
+	memcpy(tmpl->coinbase + tmpl->xnonce_offset, work->xnonce2,
+	       GBT_XNONCE_SIZE);
+	cb = tmpl->coinbase;
+
+	p = req + sprintf(req,
+		"{\"method\": \"submitblock\", \"params\": [\"");
+	p = hex_append(p, header, sizeof(header));
+	p = hex_append(p, varint, varint_enc(varint, tmpl->tx_count + 1));
+	if (tmpl->witness) {
+		/* the marker and the flag, then the reserved value */
+		static const unsigned char witness[34] = { 1, 32 };
+
+		p = hex_append(p, cb, 4);
+		p = hex_append(p, (const unsigned char *) "\0\1", 2);
+		p = hex_append(p, cb + 4, tmpl->coinbase_size - 8);
+		p = hex_append(p, witness, sizeof(witness));
+		p = hex_append(p, cb + tmpl->coinbase_size - 4, 4);
+	} else
+		p = hex_append(p, cb, tmpl->coinbase_size);
+	strcpy(p, tmpl->txs_hex);
+	p += strlen(p);
+	if (tmpl->mweb_hex)
+		p += sprintf(p, "01%s", tmpl->mweb_hex);
+	if (tmpl->workid)
+		sprintf(p, "\", {\"workid\": \"%s\"}], \"id\":1}\r\n",
+			tmpl->workid);
+	else
+		strcpy(p, "\"], \"id\":1}\r\n");
+
+	pthread_mutex_unlock(&gbt.lock);
+
+	return req;
+}
+
+/* the chain the daemon is on, as getblockchaininfo reports it, or NULL */
+static char *gbt_get_chain(void)
+{
+	static const char *req =
+		"{\"method\": \"getblockchaininfo\", \"params\": [], "
+		"\"id\":0}\r\n";
+	struct json_rpc_req *rpc;
+	const char *chain;
+	char *rc = NULL;
+	json_t *val;
+	int failures = 0;
+
+	rpc = json_rpc_req_new(rpc_url, rpc_userpass);
+	if (!rpc)
+		return NULL;
 
-	applog(LOG_INFO, "PROOF OF WORK RESULT: %s",
-	       json_is_true(res) ? "true (yay!!!)" : "false (booooo)");
+	while (!(val = json_rpc_call(rpc, req, false, false, NULL))) {
+		if ((opt_retries >= 0) && (++failures > opt_retries)) {
+			applog(LOG_ERR, "getblockchaininfo failed, giving up");
+			goto out;
+		}
+		applog(LOG_ERR, "getblockchaininfo failed, retry after %d "
+		       "seconds", opt_fail_pause);
+		sleep(opt_fail_pause);
+	}
 
+	chain = json_string_value(json_object_get(json_object_get(val,
+					"result"), "chain"));
+	if (chain)
+		rc = strdup(chain);
+	else
+		applog(LOG_ERR, "getblockchaininfo gave no chain");
 	json_decref(val);
 
-	rc = true;
+out:
+	json_rpc_req_free(rpc);
+	return rc;
+}
+
+/* the longpoll request for a template after the current one, or NULL */
+static char *gbt_longpoll_req(void)
+{
+	char *req = NULL;
+
+	pthread_mutex_lock(&gbt.lock);
+	if (gbt.longpollid) {
+		req = malloc(strlen(gbt_req) + strlen(gbt.longpollid) + 32);
+		if (req)
+			sprintf(req, "{\"method\": \"getblocktemplate\", "
+				"\"params\": [{\"capabilities\": [\"longpoll\", "
+				"\"workid\"], \"rules\": [\"segwit\", \"mweb\"], "
+				"\"longpollid\": \"%s\"}], \"id\":0}\r\n",
+				gbt.longpollid);
+	}
+	pthread_mutex_unlock(&gbt.lock);
+
+	return req;
+}
+
+/* work of the getblocktemplate reply val */
+static bool gbt_work_decode(const json_t *val, struct work *work)
+{
+	unsigned int gen = work->gen;
+	bool rc, lp;
+
+	rc = gbt_decode(json_object_get(val, "result"), NULL) &&
+	     gbt_gen_work(work);
+	work->gen = gen;
+
+	/* the template tells whether long polling is there */
+	pthread_mutex_lock(&gbt.lock);
+	lp = gbt.longpollid != NULL;
+	pthread_mutex_unlock(&gbt.lock);
+	if (rc && lp && want_longpoll && !have_longpoll) {
+		have_longpoll = true;
+		opt_scantime = 60;
+		tq_push(thr_info[longpoll_thr_id].q, strdup(rpc_url));
+	}
+
+	return rc;
+}
+
+static bool submit_stratum_work(const struct work *work)
+{
+	char *xnonce2str, *ntimestr, *noncestr, *s = NULL;
+	bool rc = false;
+
+	/* ntime and nonce are big endian, as in the getwork data */
+	xnonce2str = bin2hex(work->xnonce2, work->xnonce2_len);
+	ntimestr = bin2hex(work->data + 68, 4);
+	noncestr = bin2hex(work->data + 64 + 12, 4);
+	if (unlikely(!xnonce2str || !ntimestr || !noncestr))
+		goto out;
+
+	s = malloc(128 + strlen(rpc_user) + strlen(work->job_id) +
+		   strlen(xnonce2str));
+	if (unlikely(!s))
+		goto out;
+	sprintf(s, "{\"method\": \"mining.submit\", \"params\": "
+		"[\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\": 4}",
+		rpc_user, work->job_id, xnonce2str, ntimestr, noncestr);
+
+	/* the result comes to the stratum thread */
+	rc = stratum_send_line(&stratum, s);
 
 out:
-	free(hexstr);
+	if (!rc)
+		applog(LOG_ERR, "submit_stratum_work failed");
+	free(xnonce2str);
+	free(ntimestr);
+	free(noncestr);
+	free(s);
 	return rc;
 }
 
+/* the request which submits work, NULL if the share is to be dropped */
+static char *submit_upstream_req(const struct work *work)
+{
+	char *s, *p;
+
+	if (have_gbt)
+		return gbt_submit_req(work);
+
+	s = malloc(345);
+	if (unlikely(!s)) {
+		applog(LOG_ERR, "submit_upstream_req OOM");
+		return NULL;
+	}
+
+	/* build JSON-RPC request, with the hex string in place */
+	p = s + sprintf(s, "{\"method\": \"getwork\", \"params\": [ \"");
+	p = hex_append(p, work->data, sizeof(work->data));
+	strcpy(p, "\" ], \"id\":1}\r\n");
+
+	if (opt_debug)
+		applog(LOG_DEBUG, "DBG: sending RPC call: %s", s);
+
+	return s;
+}
+
+static void submit_upstream_result(const json_t *val)
+{
+	json_t *res = json_object_get(val, "result");
+
+	/* submitblock gives null if the block was taken, the reason otherwise */
+	if (have_gbt) {
+		applog(LOG_INFO, "PROOF OF WORK RESULT: %s",
+		       json_is_null(res) ? "true (yay!!!)" : "false (booooo)");
+		if (json_is_string(res))
+			applog(LOG_INFO, "reject reason: %s",
+			       json_string_value(res));
+	} else
+		applog(LOG_INFO, "PROOF OF WORK RESULT: %s",
+		       json_is_true(res) ? "true (yay!!!)" : "false (booooo)");
+}
+
 static const char *rpc_req =
 	"{\"method\": \"getwork\", \"params\": [], \"id\":0}\r\n";
 
-static bool get_upstream_work(CURL *curl, struct work *work)
+/* work of the reply val to rpc_req or gbt_req */
+static bool get_upstream_result(const json_t *val, int rolltime,
+				struct work *work)
 {
-	json_t *val;
 	bool rc;
 
-	val = json_rpc_call(curl, rpc_url, rpc_userpass, rpc_req,
-			    want_longpoll, false);
-	if (!val)
-		return false;
+	if (have_gbt)
+		return gbt_work_decode(val, work);
 
 	rc = work_decode(json_object_get(val, "result"), work);
-
-	json_decref(val);
+	work->roll_until = rolltime ? time(NULL) + rolltime : 0;
 
 	return rc;
 }
 
+/* an idle connection, or a new one while there are less than the most */
+static struct json_rpc_req *workio_conn_get(void)
+{
+	struct json_rpc_req *req;
+
+	if (workio_n_idle)
+		return workio_conns[--workio_n_idle];
+
+	req = json_rpc_req_new(rpc_url, rpc_userpass);
+	if (req)
+		workio_n_conns++;
+	return req;
+}
+
+/* the request of a command in flight is done with or dropped */
+static void workio_conn_put(struct workio_cmd *wc)
+{
+	curl_multi_remove_handle(workio_multi, wc->curl);
+	if (wc->cmd == WC_SUBMIT_WORK)
+		workio_n_submits--;
+	workio_conns[workio_n_idle++] = wc->req;
+	wc->req = NULL;
+	wc->curl = NULL;
+}
+
+/* drop the request of a command in flight */
+static void workio_abort(struct workio_cmd *wc)
+{
+	if (wc->curl)
+		workio_conn_put(wc);
+}
+
 static void workio_cmd_free(struct workio_cmd *wc)
 {
 	if (!wc)
 		return;
 
-	switch (wc->cmd) {
-	case WC_SUBMIT_WORK:
-		free(wc->u.work);
-		break;
-	default: /* do nothing */
-		break;
-	}
+	workio_abort(wc);
+	free(wc->u.work);
+	free(wc->rpc_req);
 
 	memset(wc, 0, sizeof(*wc));	/* poison */
 	free(wc);
 }
 
-static bool workio_get_work(struct workio_cmd *wc, CURL *curl)
+static void workio_wakeup(void)
 {
-	struct work *ret_work;
-	int failures = 0;
+#if LIBCURL_VERSION_NUM >= 0x074400
+	curl_multi_wakeup(workio_multi);
+#endif
+}
 
-	ret_work = calloc(1, sizeof(*ret_work));
-	if (!ret_work)
+/* send a command to the workio thread */
+static bool workio_push(struct workio_cmd *wc)
+{
+	if (!tq_push(thr_info[work_thr_id].q, wc))
 		return false;
+	workio_wakeup();
+	return true;
+}
+
+/* make the workio thread exit */
+static void workio_stop(void)
+{
+	workio_quit = true;
+	workio_wakeup();
+}
+
+/* a share is done with, submitted or not */
+static void submit_done(struct workio_cmd *wc, bool submitted)
+{
+	struct timeval tv_end, diff;
+	double msecs = 0;
+	int depth;
+
+	if (submitted) {
+		gettimeofday(&tv_end, NULL);
+		timeval_subtract(&diff, &tv_end, &wc->tv_found);
+		msecs = diff.tv_sec * 1000.0 + diff.tv_usec / 1000.0;
+	}
+
+	pthread_mutex_lock(&stats_lock);
+	depth = --submit_q_depth;
+	if (submitted) {
+		submit_count++;
+		submit_time_total += msecs;
+	}
+	pthread_mutex_unlock(&stats_lock);
+
+	if (submitted && !opt_quiet)
+		applog(LOG_INFO, "share submitted in %.1f ms, %d more pending "
+		       "(%.1f ms on average)", msecs, depth,
+		       submit_time_total / submit_count);
+}
+
+/* a command failed, true if it is to be retried */
+static bool workio_failed(struct workio_cmd *wc, time_t now)
+{
+	int backoff;
 
-	/* obtain new work from bitcoin via JSON-RPC */
-	while (!get_upstream_work(curl, ret_work)) {
-		if (unlikely((opt_retries >= 0) && (++failures > opt_retries))) {
+	if (wc->cmd == WC_GET_WORK) {
+		if (unlikely((opt_retries >= 0) && (++wc->failures > opt_retries))) {
 			applog(LOG_ERR, "json_rpc_call failed, terminating workio thread");
-			free(ret_work);
+			workio_quit = true;
 			return false;
 		}
 
-		/* pause, then restart work-request loop */
 		applog(LOG_ERR, "json_rpc_call failed, retry after %d seconds",
 			opt_fail_pause);
-		sleep(opt_fail_pause);
+		wc->retry_at = now + opt_fail_pause;
+		return true;
 	}
 
-	/* send work to requesting thread */
-	if (!tq_push(wc->thr->q, ret_work))
-		free(ret_work);
+	if (unlikely((opt_retries >= 0) && (++wc->failures > opt_retries))) {
+		applog(LOG_ERR, "...giving up on the share");
+		submit_done(wc, false);
+		return false;
+	}
 
+	/* from a second up to the retry pause */
+	backoff = wc->failures < 16 ? 1 << (wc->failures - 1) : opt_fail_pause;
+	if (backoff > opt_fail_pause)
+		backoff = opt_fail_pause;
+	wc->retry_at = now + backoff;
+	applog(LOG_ERR, "...retry after %d seconds", backoff);
 	return true;
 }
 
-static bool workio_submit_work(struct workio_cmd *wc, CURL *curl)
+/* start a command, false if it is done with already */
+static bool workio_send(struct workio_cmd *wc, time_t now)
 {
-	int failures = 0;
+	const char *body;
+
+	if (wc->cmd == WC_GET_WORK) {
+		wc->u.work->gen = work_gen;
+		body = have_gbt ? gbt_req : rpc_req;
+	} else {
+		/* a retry is pointless after a new block */
+		if (wc->failures && wc->u.work->gen != work_gen) {
+			applog(LOG_ERR, "Share is stale now, dropping it");
+			submit_done(wc, false);
+			return false;
+		}
 
-	/* submit solution to bitcoin via JSON-RPC */
-	while (!submit_upstream_work(curl, wc->u.work)) {
-		if (unlikely((opt_retries >= 0) && (++failures > opt_retries))) {
-			applog(LOG_ERR, "...terminating workio thread");
+		/* Stratum shares go out on its connection, right away */
+		if (have_stratum) {
+			if (!submit_stratum_work(wc->u.work))
+				return workio_failed(wc, now);
+			submit_done(wc, true);
 			return false;
 		}
 
-		/* pause, then restart work-request loop */
-		applog(LOG_ERR, "...retry after %d seconds",
-			opt_fail_pause);
-		sleep(opt_fail_pause);
-	}
+		/* a block is built once, its template may be gone later */
+		if (!wc->rpc_req) {
+			wc->rpc_req = submit_upstream_req(wc->u.work);
+			if (!wc->rpc_req) {
+				submit_done(wc, false);
+				return false;
+			}
+		}
+		body = wc->rpc_req;
+
+		/* hanging submits must not stall getwork */
+		if (workio_n_submits >= WORKIO_MAX_CONNS - 1)
+			return true;
+	}
+
+	/* all connections busy, it waits for one */
+	if (!workio_n_idle && workio_n_conns == WORKIO_MAX_CONNS)
+		return true;
+	wc->req = workio_conn_get();
+	if (unlikely(!wc->req))
+		return workio_failed(wc, now);
+
+	/* a stuck request must not hold up its work for long */
+	wc->curl = json_rpc_req_start(wc->req, body, wc->cmd == WC_GET_WORK &&
+				      !have_gbt, opt_timeout);
+	curl_easy_setopt(wc->curl, CURLOPT_PRIVATE, wc);
+	curl_multi_add_handle(workio_multi, wc->curl);
+	if (wc->cmd == WC_SUBMIT_WORK)
+		workio_n_submits++;
+
+	return true;
+}
+
+/* a request is finished with 'rc', false if its command is done with */
+static bool workio_recv(struct workio_cmd *wc, CURLcode rc, time_t now)
+{
+	int rolltime = 0;
+	json_t *val;
+	bool ok;
+
+	val = json_rpc_req_done(wc->req, rc, &rolltime);
+	workio_conn_put(wc);
+	if (unlikely(!val))
+		return workio_failed(wc, now);
+
+	if (wc->cmd == WC_SUBMIT_WORK) {
+		submit_upstream_result(val);
+		json_decref(val);
+		submit_done(wc, true);
+		return false;
+	}
+
+	ok = get_upstream_result(val, rolltime, wc->u.work);
+	json_decref(val);
+	if (unlikely(!ok))
+		return workio_failed(wc, now);
+
+	/* queue the work for the miner threads */
+	pthread_mutex_lock(&stats_lock);
+	if (tq_push(work_q, wc->u.work)) {
+		work_q_ready++;
+		wc->u.work = NULL;
+	}
+	pthread_mutex_unlock(&stats_lock);
+
+	return false;
+}
+
+/* take a new command, the oldest share to retry goes if there are many */
+static bool workio_add(struct list_head *cmds, struct workio_cmd *wc)
+{
+	struct workio_cmd *iter, *oldest = NULL;
+	int n_retries = 0;
+
+	if (wc->cmd == WC_GET_WORK) {
+		wc->u.work = calloc(1, sizeof(*wc->u.work));
+		if (!wc->u.work)
+			return false;
+	} else {
+		list_for_each_entry(iter, cmds, list) {
+			if (iter->cmd != WC_SUBMIT_WORK || !iter->failures ||
+			    iter->curl)
+				continue;
+			if (!oldest)
+				oldest = iter;
+			n_retries++;
+		}
+		if (n_retries >= SUBMIT_MAX_PENDING) {
+			applog(LOG_ERR, "Too many shares to retry, "
+			       "dropping the oldest");
+			submit_done(oldest, false);
+			list_del(&oldest->list);
+			workio_cmd_free(oldest);
+		}
+	}
+
+	list_add_tail(&wc->list, cmds);
+	return true;
+}
+
+static void *workio_thread(void *userdata)
+{
+	struct thr_info *mythr = userdata;
+	struct workio_cmd *wc, *tmp;
+	LIST_HEAD(cmds);
+
+	while (!workio_quit) {
+		struct timespec zero = { };
+		CURLMsg *msg;
+		time_t now;
+		int timeout = WORKIO_POLL_MS;
+		int running, left;
+
+		/* take the commands sent to us, on our queue */
+		while ((wc = tq_pop(mythr->q, &zero))) {
+			if (!workio_add(&cmds, wc)) {
+				workio_quit = true;
+				workio_cmd_free(wc);
+			}
+		}
+		if (workio_quit)
+			break;
+
+		curl_multi_perform(workio_multi, &running);
+		while ((msg = curl_multi_info_read(workio_multi, &left))) {
+			CURLcode rc = msg->data.result;
+			char *priv;
+
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE,
+					  &priv);
+			wc = (struct workio_cmd *) priv;
+			if (!workio_recv(wc, rc, time(NULL))) {
+				list_del(&wc->list);
+				workio_cmd_free(wc);
+			}
+		}
+		if (workio_quit)
+			break;
+
+		/* start what is due, and fetch stale work again */
+		now = time(NULL);
+		list_for_each_entry_safe(wc, tmp, &cmds, list) {
+			if (wc->curl) {
+				/* the reply would be for the last block */
+				if (wc->cmd != WC_GET_WORK ||
+				    wc->u.work->gen == work_gen)
+					continue;
+				workio_abort(wc);
+				if (opt_debug)
+					applog(LOG_DEBUG, "DBG: getwork "
+					       "restarted after a new block");
+			} else if (wc->retry_at > now) {
+				if (timeout > (wc->retry_at - now) * 1000)
+					timeout = (wc->retry_at - now) * 1000;
+				continue;
+			}
+
+			if (!workio_send(wc, now)) {
+				list_del(&wc->list);
+				workio_cmd_free(wc);
+			}
+		}
+		if (workio_quit)
+			break;
+
+		/* wait for the server, a new command or a retry */
+#if LIBCURL_VERSION_NUM >= 0x074400
+		curl_multi_poll(workio_multi, NULL, 0, timeout, NULL);
+#else
+		/* no wakeup, a new command is seen at the next timeout */
+		if (timeout > WORKIO_POLL_MS / 10)
+			timeout = WORKIO_POLL_MS / 10;
+		if (workio_n_idle < workio_n_conns)
+			curl_multi_wait(workio_multi, NULL, 0, timeout, NULL);
+		else
+			usleep(timeout * 1000);
+#endif
+	}
+
+	tq_freeze(mythr->q);
+	tq_freeze(work_q);	/* wake up get_work, there is no more */
+	list_for_each_entry_safe(wc, tmp, &cmds, list) {
+		list_del(&wc->list);
+		workio_cmd_free(wc);
+	}
+	while (workio_n_idle)
+		json_rpc_req_free(workio_conns[--workio_n_idle]);
+
+	return NULL;
+}
+
+static void hashmeter(int thr_id, const struct timeval *diff,
+		      unsigned long hashes_done)
+{
+	double khashes, secs;
+
+	khashes = hashes_done / 1000.0;
+	secs = (double)diff->tv_sec + ((double)diff->tv_usec / 1000000.0);
+
+	if (!opt_quiet)
+		applog(LOG_INFO, "thread %d: %lu hashes, %.2f khash/sec",
+		       thr_id, hashes_done,
+		       khashes / secs);
+
+	/* with more than one NUMA node, also report the total of each */
+	if (thr_info[thr_id].node >= 0) {
+		int node = thr_info[thr_id].node;
+		double node_khashes = 0;
+		int i;
+
+		pthread_mutex_lock(&stats_lock);
+		thr_hashrates[thr_id] = khashes / secs;
+		for (i = 0; i < opt_n_threads; i++)
+			if (thr_info[i].node == node)
+				node_khashes += thr_hashrates[i];
+		pthread_mutex_unlock(&stats_lock);
+
+		if (!opt_quiet)
+			applog(LOG_INFO, "node %d: %.2f khash/sec",
+			       node, node_khashes);
+	}
+}
+
+/* keep 'depth' work units queued or on their way, with g_work_lock held */
+static bool request_work(struct thr_info *thr, int depth)
+{
+	struct workio_cmd *wc;
+
+	while (work_q_pending < depth) {
+		/* fill out work request message */
+		wc = calloc(1, sizeof(*wc));
+		if (!wc)
+			return false;
+
+		wc->cmd = WC_GET_WORK;
+		wc->thr = thr;
+
+		/* send work request to workio thread */
+		if (!workio_push(wc)) {
+			workio_cmd_free(wc);
+			return false;
+		}
+		work_q_pending++;
+	}
+
+	return true;
+}
+
+/* drop the queued work units, with g_work_lock held */
+static void flush_work(void)
+{
+	struct timespec now = { };
+	struct work *work_heap;
+
+	while ((work_heap = tq_pop(work_q, &now))) {
+		pthread_mutex_lock(&stats_lock);
+		work_q_ready--;
+		pthread_mutex_unlock(&stats_lock);
+		work_q_pending--;
+		free(work_heap);
+	}
+}
+
+/* take the next work unit of the queue, with g_work_lock held */
+static bool get_work(struct thr_info *thr, struct work *work)
+{
+	struct work *work_heap;
+	struct timeval tv_start, tv_end, diff;
+	double wait;
+	int ready;
+
+	gettimeofday(&tv_start, NULL);
+
+	do {
+		/* with an empty queue, fetch on demand */
+		if (!request_work(thr, 1))
+			return false;
+
+		/* wait for a unit of work */
+		work_heap = tq_pop(work_q, NULL);
+		if (!work_heap)
+			return false;
+		work_q_pending--;
+		pthread_mutex_lock(&stats_lock);
+		ready = --work_q_ready;
+		pthread_mutex_unlock(&stats_lock);
+
+		/* requested before the last new block, or its template is gone */
+		if (work_heap->gen != work_gen || !gbt_work_kept(work_heap)) {
+			free(work_heap);
+			work_heap = NULL;
+		}
+	} while (!work_heap);
+
+	gettimeofday(&tv_end, NULL);
+	timeval_subtract(&diff, &tv_end, &tv_start);
+	wait = diff.tv_sec * 1000.0 + diff.tv_usec / 1000.0;
+	work_waits++;
+	work_wait_total += wait;
+
+	/* copy returned work into storage provided by caller */
+	memcpy(work, work_heap, sizeof(*work));
+	free(work_heap);
+
+	/* and refill the queue ahead of the next one */
+	request_work(thr, opt_queue);
+
+	if (!opt_quiet)
+		applog(LOG_INFO, "new work: %d more queued, waited %.1f ms "
+		       "(%.1f ms on average)", ready, wait,
+		       work_wait_total / work_waits);
 
 	return true;
 }
 
-static void *workio_thread(void *userdata)
+/* the share target for the Stratum difficulty, which is scaled for scrypt */
+static void diff_to_target(unsigned char *target, double diff)
 {
-	struct thr_info *mythr = userdata;
-	CURL *curl;
-	bool ok = true;
-
-	curl = curl_easy_init();
-	if (unlikely(!curl)) {
-		applog(LOG_ERR, "CURL initialization failed");
-		return NULL;
+	uint64_t m;
+	int k;
+
+	diff /= 65536.0;
+	for (k = 6; k > 0 && diff > 1.0; k--)
+		diff /= 4294967296.0;
+	m = 4294901760.0 / diff;
+	if (m == 0 && k == 6)
+		memset(target, 0xff, 32);
+	else {
+		memset(target, 0, 32);
+		le32enc_bytes(target + k * 4, (uint32_t)m);
+		le32enc_bytes(target + k * 4 + 4, (uint32_t)(m >> 32));
 	}
+}
 
-	while (ok) {
-		struct workio_cmd *wc;
+/*
+ * Build work out of the current Stratum job with the next extranonce2.
+ * Returns false if there is no job yet.
+ */
+static bool stratum_gen_work(struct stratum_ctx *sctx, struct work *work)
+{
+	unsigned char merkle_root[64];
+	int i;
 
-		/* wait for workio_cmd sent to us, on our queue */
-		wc = tq_pop(mythr->q, NULL);
-		if (!wc) {
-			ok = false;
-			break;
-		}
+	pthread_mutex_lock(&sctx->work_lock);
 
-		/* process workio_cmd */
-		switch (wc->cmd) {
-		case WC_GET_WORK:
-			ok = workio_get_work(wc, curl);
-			break;
-		case WC_SUBMIT_WORK:
-			ok = workio_submit_work(wc, curl);
-			break;
+	if (!sctx->job.job_id ||
+	    strlen(sctx->job.job_id) >= sizeof(work->job_id)) {
+		pthread_mutex_unlock(&sctx->work_lock);
+		return false;
+	}
 
-		default:		/* should never happen */
-			ok = false;
-			break;
-		}
+	memset(work, 0, sizeof(*work));
+	strcpy(work->job_id, sctx->job.job_id);
+	work->xnonce2_len = sctx->xnonce2_size;
+	memcpy(work->xnonce2, sctx->job.xnonce2, sctx->xnonce2_size);
 
-		workio_cmd_free(wc);
+	/* the merkle root, from the coinbase up the branch */
+	sha256d(merkle_root, sctx->job.coinbase, sctx->job.coinbase_size);
+	for (i = 0; i < sctx->job.merkle_count; i++) {
+		memcpy(merkle_root + 32, sctx->job.merkle[i], 32);
+		sha256d(merkle_root, merkle_root, 64);
 	}
 
-	tq_freeze(mythr->q);
-	curl_easy_cleanup(curl);
+	/* the next work gets the next extranonce2 */
+	for (i = 0; i < (int)sctx->xnonce2_size && !++sctx->job.xnonce2[i]; i++)
+		;
 
-	return NULL;
-}
+	/* the header and its SHA-256 padding, as getwork would send them */
+	memcpy(work->data, sctx->job.version, 4);
+	memcpy(work->data + 4, sctx->job.prevhash, 32);
+	for (i = 0; i < 32; i++)
+		work->data[36 + i] = merkle_root[(i & ~3) + 3 - (i & 3)];
+	memcpy(work->data + 68, sctx->job.ntime, 4);
+	memcpy(work->data + 72, sctx->job.nbits, 4);
+	le32enc_bytes(work->data + 80, 0x80000000);
+	le32enc_bytes(work->data + 124, 0x00000280);
 
-static void hashmeter(int thr_id, const struct timeval *diff,
-		      unsigned long hashes_done)
-{
-	double khashes, secs;
+	diff_to_target(work->target, sctx->job.diff);
 
-	khashes = hashes_done / 1000.0;
-	secs = (double)diff->tv_sec + ((double)diff->tv_usec / 1000000.0);
+	pthread_mutex_unlock(&sctx->work_lock);
 
-	if (!opt_quiet)
-		applog(LOG_INFO, "thread %d: %lu hashes, %.2f khash/sec",
-		       thr_id, hashes_done,
-		       khashes / secs);
+	return true;
 }
 
-static bool get_work(struct thr_info *thr, struct work *work)
+static void work_set_nonce(struct work *work, uint32_t nonce)
 {
-	struct workio_cmd *wc;
-	struct work *work_heap;
+	work->data[64 + 12] = nonce >> 24;
+	work->data[64 + 13] = nonce >> 16;
+	work->data[64 + 14] = nonce >> 8;
+	work->data[64 + 15] = nonce;
+}
 
-	/* fill out work request message */
-	wc = calloc(1, sizeof(*wc));
-	if (!wc)
+/*
+ * Move the ntime of the work on by the seconds since 'since', and by one
+ * at least so that the work differs, if the server allowed that with
+ * X-Roll-NTime. The work is new then without a getwork round trip.
+ */
+static bool roll_work(struct work *work, time_t now, time_t since)
+{
+	uint32_t ntime;
+
+	if (!work->roll_until || now >= work->roll_until)
 		return false;
 
-	wc->cmd = WC_GET_WORK;
-	wc->thr = thr;
+	/* big endian, as it is byte swapped in the data */
+	ntime = ((uint32_t)work->data[68] << 24) | (work->data[69] << 16) |
+		(work->data[70] << 8) | work->data[71];
+	ntime += now > since ? now - since : 1;
+	work->data[68] = ntime >> 24;
+	work->data[69] = ntime >> 16;
+	work->data[70] = ntime >> 8;
+	work->data[71] = ntime;
 
-	/* send work request to workio thread */
-	if (!tq_push(thr_info[work_thr_id].q, wc)) {
-		workio_cmd_free(wc);
-		return false;
+	return true;
+}
+
+/*
+ * Hand out the next 'count' nonces of the shared work unit, fetching a new
+ * one when it is stale or its nonces ran out. The header of the returned
+ * work holds the nonce the scan starts after and the range ends with
+ * '*end_nonce'. This also clears the restart flag of the thread: a restart
+ * signalled from here on is for the work we return.
+ */
+static bool get_work_range(struct thr_info *thr, struct work *work,
+			   uint32_t count, uint32_t *first_nonce,
+			   uint32_t *end_nonce)
+{
+	bool rc = true;
+	time_t now;
+
+retry:
+	pthread_mutex_lock(&g_work_lock);
+
+	now = time(NULL);
+	if (!g_work_time || now - g_work_time >= opt_scantime ||
+	    g_work_nonce >= WORK_MAX_NONCE) {
+		if (g_work_time && roll_work(&g_work, now, g_work_time)) {
+			if (opt_debug)
+				applog(LOG_DEBUG, "DBG: rolled ntime of work");
+		} else if (have_stratum) {
+			/* built locally, wait for the first job though */
+			if (!stratum_gen_work(&stratum, &g_work)) {
+				g_work_time = 0;
+				pthread_mutex_unlock(&g_work_lock);
+				sleep(1);
+				goto retry;
+			}
+		} else if (unlikely(!get_work(thr, &g_work))) {
+			g_work_time = 0;
+			rc = false;
+			goto out;
+		}
+		time(&g_work_time);
+		g_work_nonce = 0;
 	}
 
-	/* wait for response, a unit of work */
-	work_heap = tq_pop(thr->q, NULL);
-	if (!work_heap)
-		return false;
+	if (count > WORK_MAX_NONCE - g_work_nonce)
+		count = WORK_MAX_NONCE - g_work_nonce;
 
-	/* copy returned work into storage provided by caller */
-	memcpy(work, work_heap, sizeof(*work));
-	free(work_heap);
+	memcpy(work, &g_work, sizeof(*work));
+	work_set_nonce(work, g_work_nonce);
+	*first_nonce = g_work_nonce;
+	*end_nonce = g_work_nonce += count;
+	work_restart[thr->id].restart = 0;
 
-	return true;
+out:
+	pthread_mutex_unlock(&g_work_lock);
+	return rc;
 }
 
 static bool submit_work(struct thr_info *thr, const struct work *work_in)
@@ -500,10 +1771,18 @@ static bool submit_work(struct thr_info *thr, const struct work *work_in)
 	wc->cmd = WC_SUBMIT_WORK;
 	wc->thr = thr;
 	memcpy(wc->u.work, work_in, sizeof(*work_in));
+	gettimeofday(&wc->tv_found, NULL);
 
 	/* send solution to workio thread */
-	if (!tq_push(thr_info[work_thr_id].q, wc))
+	pthread_mutex_lock(&stats_lock);
+	submit_q_depth++;
+	pthread_mutex_unlock(&stats_lock);
+	if (!workio_push(wc)) {
+		pthread_mutex_lock(&stats_lock);
+		submit_q_depth--;
+		pthread_mutex_unlock(&stats_lock);
 		goto err_out;
+	}
 
 	return true;
 
@@ -515,16 +1794,27 @@ err_out:
 #ifdef HAVE_CELL_SPU
 #include "scrypt-cell-spu.h"
 /* Each SPU core is processing 8 hashes as once and needs 8x memory */
-#define SCRATCHBUF_SIZE (131583 * 8)
+#define SCRATCHBUF_SIZE SCRYPT_SCRATCHBUF_SIZE(8, 1)
 #else
-#define SCRATCHBUF_SIZE (131583 * 2)
+#define SCRATCHBUF_SIZE \
+	SCRYPT_SCRATCHBUF_SIZE(scrypt_impl->lanes, opt_lookup_gap)
 #endif
 
+/*
+ * Start the scratchpad of every thread at a different offset. They are
+ * all aligned to huge pages, so the same V entries of the threads sharing
+ * a core or a cache would otherwise map to the same cache sets. The step
+ * is an odd number of cache lines to cycle through all of them.
+ */
+#define SCRATCHBUF_COLOR_MAX	4096
+#define SCRATCHBUF_COLOR(thr_id) (((thr_id) * 9 * 64) % SCRATCHBUF_COLOR_MAX)
+
 static void *miner_thread(void *userdata)
 {
 	struct thr_info *mythr = userdata;
 	int thr_id = mythr->id;
-	uint32_t max_nonce = 0xffffff;
+	uint32_t max_nonce = 0xffffff;	/* nonces per range */
+	struct scratchbuf sb = { };
 	unsigned char *scratchbuf = NULL;
 
 	/* Set worker threads to nice 19 and then preferentially to SCHED_IDLE
@@ -535,91 +1825,299 @@ static void *miner_thread(void *userdata)
 
 	/* Cpu affinity only makes sense if the number of threads is a multiple
 	 * of the number of CPUs */
-	if (!(opt_n_threads % num_processors))
+	if (!(opt_n_threads % num_processors)) {
 		affine_to_cpu(mythr->id, mythr->id % num_processors);
-	
+		if (opt_numa)
+			mythr->node = numa_bind_thread(mythr->id,
+						mythr->id % num_processors);
+	} else if (opt_numa)
+		mythr->node = numa_bind_thread(mythr->id, -1);
+
+	/* the scratchpad is faulted in from here, so it is on our node */
 	if (opt_algo == ALGO_SCRYPT)
 	{
-		scratchbuf = malloc(SCRATCHBUF_SIZE);
+		if (unlikely(!scratchbuf_alloc(&sb, SCRATCHBUF_SIZE +
+					       SCRATCHBUF_COLOR_MAX,
+					       opt_huge_pages,
+					       opt_lock_memory))) {
+			applog(LOG_ERR, "thread %d: scratchpad allocation "
+			       "failed", thr_id);
+			goto out;
+		}
+		applog(LOG_INFO, "thread %d: %lu KiB scratchpad in %s%s",
+		       thr_id, (unsigned long)(sb.size / 1024), sb.backing,
+		       sb.locked ? ", locked" : "");
+		scratchbuf = sb.buf + SCRATCHBUF_COLOR(thr_id);
 		max_nonce = 0xffff;
 	}
 
 	while (1) {
 		struct work work __attribute__((aligned(128)));
-		unsigned long hashes_done;
+		unsigned long hashes_done, total_hashes;
+		uint32_t first_nonce, end_nonce;
 		struct timeval tv_start, tv_end, diff;
 		int diffms;
 		uint64_t max64;
 		bool rc;
 
-		/* obtain new work from internal workio thread */
-		if (unlikely(!get_work(mythr, &work))) {
+		/* take a range of nonces of the current work */
+		if (unlikely(!get_work_range(mythr, &work, max_nonce,
+					     &first_nonce, &end_nonce))) {
 			applog(LOG_ERR, "work retrieval failed, exiting "
 				"mining thread %d", mythr->id);
 			goto out;
 		}
 
-		hashes_done = 0;
+		total_hashes = 0;
 		gettimeofday(&tv_start, NULL);
 
-		/* scan nonces for a proof-of-work hash */
-		switch (opt_algo) {
-		case ALGO_SCRYPT:
+		/*
+		 * Scan nonces for proof-of-work hashes. A share does not end
+		 * the scan: it is queued for submission and the scan goes on
+		 * with the next nonce, until the end of the range or a restart.
+		 */
+		do {
+			hashes_done = 0;
+
+			switch (opt_algo) {
+			case ALGO_SCRYPT:
 #ifdef HAVE_CELL_SPU
-			if (mythr->spe_context) {
-				scanhash_spu_args *argp = (scanhash_spu_args *)
-					(((uintptr_t)scratchbuf + 127) & ~(uintptr_t)127);
-				spe_stop_info_t stop_info;
-				unsigned int entry = SPE_DEFAULT_ENTRY;
-				memcpy(argp->data, work.data, sizeof(work.data));
-				memcpy(argp->target, work.target, sizeof(work.target));
-				argp->max_nonce = max_nonce;
-				argp->hashes_done = 0;
-				work_restart[thr_id].restart = 0;
-				spe_context_run(mythr->spe_context, &entry, 0, argp,
-						(void *)&work_restart[thr_id].restart, &stop_info);
-				hashes_done = argp->hashes_done;
-				memcpy(work.data, argp->data, sizeof(work.data));
-				rc = stop_info.result.spe_exit_code;
+				if (mythr->spe_context) {
+					scanhash_spu_args *argp = (scanhash_spu_args *)
+						(((uintptr_t)scratchbuf + 127) & ~(uintptr_t)127);
+					spe_stop_info_t stop_info;
+					unsigned int entry = SPE_DEFAULT_ENTRY;
+					memcpy(argp->data, work.data, sizeof(work.data));
+					memcpy(argp->target, work.target, sizeof(work.target));
+					argp->max_nonce = end_nonce;
+					argp->hashes_done = 0;
+					spe_context_run(mythr->spe_context, &entry, 0, argp,
+							(void *)&work_restart[thr_id].restart, &stop_info);
+					hashes_done = argp->hashes_done;
+					memcpy(work.data, argp->data, sizeof(work.data));
+					rc = stop_info.result.spe_exit_code;
+					break;
+				}
+#endif
+				rc = scanhash_scrypt(thr_id, work.data, scratchbuf,
+				                     work.target, end_nonce,
+				                     &hashes_done);
 				break;
+
+			default:
+				/* should never happen */
+				goto out;
+			}
+
+			total_hashes += hashes_done;
+
+#ifdef HAVE_CELL_SPU
+			/* the SPU only checks the top word of the hash */
+			if (rc && mythr->spe_context &&
+			    !scrypt_fulltest(work.data, scratchbuf,
+					     work.target)) {
+				applog(LOG_DEBUG, "thread %d: hash above the "
+				       "target, share dropped", thr_id);
+				continue;
 			}
 #endif
-			rc = scanhash_scrypt(thr_id, work.data, scratchbuf,
-			                     work.target, max_nonce, &hashes_done);
-			break;
 
-		default:
-			/* should never happen */
-			goto out;
-		}
+			/* if nonce found, submit work */
+			if (rc && !submit_work(mythr, &work))
+				goto out;
+		} while (rc && first_nonce + total_hashes < end_nonce &&
+			 !work_restart[thr_id].restart);
 
 		/* record scanhash elapsed time */
 		gettimeofday(&tv_end, NULL);
 		timeval_subtract(&diff, &tv_end, &tv_start);
 
-		hashmeter(thr_id, &diff, hashes_done);
+		hashmeter(thr_id, &diff, total_hashes);
 
 		/* adjust max_nonce to meet target scan time */
 		diffms = diff.tv_sec * 1000 + diff.tv_usec / 1000;
-		if (diffms > 0) {
+		if (diffms > 0 && total_hashes) {
 			max64 =
-			   ((uint64_t)hashes_done * opt_scantime * 1000) / diffms;
-			if (max64 > 0xfffffffaULL)
-				max64 = 0xfffffffaULL;
+			   ((uint64_t)total_hashes * opt_scantime * 1000) / diffms;
+			if (max64 > WORK_MAX_NONCE)
+				max64 = WORK_MAX_NONCE;
 			max_nonce = max64;
 		}
-
-		/* if nonce found, submit work */
-		if (rc && !submit_work(mythr, &work))
-			break;
 	}
 
 out:
 	tq_freeze(mythr->q);
+	scratchbuf_free(&sb);
+
+	return NULL;
+}
+
+/*
+ * Get the lookup gap to be used with the given number of lanes: either the
+ * one from the command line, or the smallest one which fits the memory
+ * budget. Returns 0 if the kernel can't fit the budget at all.
+ */
+static int scrypt_lookup_gap(int lanes)
+{
+	int gap = opt_lookup_gap_set ? opt_lookup_gap : 1;
+
+	if (!opt_max_memory)
+		return gap;
+
+	while (SCRYPT_SCRATCHBUF_SIZE(lanes, gap) > opt_max_memory * 1024) {
+		if (opt_lookup_gap_set || gap >= SCRYPT_MAX_LOOKUP_GAP)
+			return 0;
+		gap++;
+	}
+	return gap;
+}
+
+#define AUTOTUNE_MSECS	1000
+
+struct autotune_ctx {
+	pthread_t			pth;
+	int				thr_id;
+	const struct scrypt_impl	*impl;
+	double				khashes;	/* khash/sec */
+};
+
+static void *autotune_thread(void *userdata)
+{
+	struct autotune_ctx *ctx = userdata;
+	const struct scrypt_impl *impl = ctx->impl;
+	unsigned char data[128] __attribute__((aligned(128))) = { };
+	unsigned char target[32] = { };
+	struct scratchbuf sb;
+	unsigned long hashes_done, total = 0;
+	struct timeval tv_start, tv_end, diff;
+	int diffms;
+
+	/* same kind of memory as the miner threads are going to get */
+	if (!scratchbuf_alloc(&sb,
+			      SCRYPT_SCRATCHBUF_SIZE(impl->lanes, opt_lookup_gap),
+			      opt_huge_pages, false))
+		return NULL;
+
+	work_restart[ctx->thr_id].restart = 0;
+
+	/* the first run warms up the caches and is not counted */
+	scrypt_impl_scanhash(impl, ctx->thr_id, data, sb.buf, target,
+			     impl->lanes, &hashes_done);
+
+	gettimeofday(&tv_start, NULL);
+	do {
+		scrypt_impl_scanhash(impl, ctx->thr_id, data, sb.buf, target,
+				     impl->lanes * 16, &hashes_done);
+		total += hashes_done;
+
+		gettimeofday(&tv_end, NULL);
+		timeval_subtract(&diff, &tv_end, &tv_start);
+		diffms = diff.tv_sec * 1000 + diff.tv_usec / 1000;
+	} while (diffms < AUTOTUNE_MSECS);
 
+	ctx->khashes = total / (double)diffms;
+
+	scratchbuf_free(&sb);
 	return NULL;
 }
 
+/* Run 'impl' on 'n_threads' threads at once, returns the total khash/sec */
+static double autotune_run(struct autotune_ctx *ctx, int *n_threads,
+			   const struct scrypt_impl *impl)
+{
+	double khashes = 0;
+	int i;
+
+	for (i = 0; i < *n_threads; i++) {
+		ctx[i].thr_id = i;
+		ctx[i].impl = impl;
+		ctx[i].khashes = 0;
+		if (unlikely(pthread_create(&ctx[i].pth, NULL,
+					    autotune_thread, &ctx[i]))) {
+			applog(LOG_ERR, "benchmark thread create failed");
+			*n_threads = i;
+			break;
+		}
+	}
+	for (i = 0; i < *n_threads; i++) {
+		pthread_join(ctx[i].pth, NULL);
+		khashes += ctx[i].khashes;
+	}
+	return khashes;
+}
+
+/*
+ * Run every available scrypt kernel on 'n_threads' threads at once and
+ * pick the one with the best total hash rate. All the threads have to run
+ * simultaneously, because the winner depends on the available memory
+ * bandwidth and cache size per thread. The SHA-256 implementation used
+ * for PBKDF2 is picked the same way beforehand.
+ */
+static void autotune_scrypt(int n_threads)
+{
+	const struct scrypt_impl *impl, *best = NULL;
+	struct autotune_ctx *ctx;
+	double best_khashes = 0;
+	int best_gap = scrypt_lookup_gap(scrypt_impl->lanes);
+
+	ctx = calloc(n_threads, sizeof(*ctx));
+	if (!ctx)
+		return;
+
+	applog(LOG_INFO, "Benchmarking scrypt kernels with %d threads",
+	       n_threads);
+
+	if (opt_sha_ni && scrypt_sha256_shani_usable() && best_gap) {
+		double shani, scalar;
+
+		opt_lookup_gap = best_gap;
+		scrypt_sha256_use_shani(true);
+		shani = autotune_run(ctx, &n_threads, scrypt_impl);
+		scrypt_sha256_use_shani(false);
+		scalar = autotune_run(ctx, &n_threads, scrypt_impl);
+		if (!n_threads)
+			goto out;
+
+		applog(LOG_INFO, "SHA-256 with SHA-NI: %.2f khash/sec, "
+		       "without: %.2f khash/sec", shani, scalar);
+		opt_sha_ni = shani > scalar;
+		scrypt_sha256_use_shani(opt_sha_ni);
+	}
+
+	for (impl = scrypt_impls; impl->name; impl++) {
+		double khashes;
+		int gap = scrypt_lookup_gap(impl->lanes);
+
+		if (!gap) {
+			applog(LOG_INFO, "scrypt kernel '%s': does not fit "
+			       "in %lu KiB", impl->name, opt_max_memory);
+			continue;
+		}
+		opt_lookup_gap = gap;
+
+		khashes = autotune_run(ctx, &n_threads, impl);
+		if (!n_threads)
+			break;
+
+		applog(LOG_INFO, "scrypt kernel '%s' (lookup gap %d): "
+		       "%.2f khash/sec, %.2f khash/sec per thread",
+		       impl->name, gap, khashes, khashes / n_threads);
+
+		if (khashes > best_khashes) {
+			best_khashes = khashes;
+			best = impl;
+			best_gap = gap;
+		}
+	}
+
+	if (best)
+		scrypt_impl = best;
+out:
+	opt_lookup_gap = best_gap;
+
+	free(ctx);
+}
+
 static void restart_threads(void)
 {
 	int i;
@@ -631,7 +2129,7 @@ static void restart_threads(void)
 static void *longpoll_thread(void *userdata)
 {
 	struct thr_info *mythr = userdata;
-	CURL *curl = NULL;
+	struct json_rpc_req *lp_req = NULL;
 	char *copy_start, *hdr_path, *lp_url = NULL;
 	bool need_slash = false;
 	int failures = 0;
@@ -661,23 +2159,68 @@ static void *longpoll_thread(void *userdata)
 
 	applog(LOG_INFO, "Long-polling activated for %s", lp_url);
 
-	curl = curl_easy_init();
-	if (unlikely(!curl)) {
-		applog(LOG_ERR, "CURL initialization failed");
+	lp_req = json_rpc_req_new(lp_url, rpc_userpass);
+	if (unlikely(!lp_req))
 		goto out;
-	}
 
 	while (1) {
 		json_t *val;
+		char *req = NULL;
+		bool new_block = true, ok = true;
+		int rolltime;
 
-		val = json_rpc_call(curl, lp_url, rpc_userpass, rpc_req,
-				    false, true);
+		if (have_gbt && !(req = gbt_longpoll_req()))
+			goto out;
+		val = json_rpc_call(lp_req, req ? req : rpc_req, false, true,
+				    &rolltime);
+		free(req);
 		if (likely(val)) {
 			failures = 0;
-			json_decref(val);
 
-			applog(LOG_INFO, "LONGPOLL detected new block");
+			/*
+			 * A template may come back for new transactions only,
+			 * the work on the old one is still good then, and so
+			 * are the shares of it, but the threads are moved to
+			 * the new one before that is gone.
+			 */
+			if (have_gbt)
+				ok = gbt_decode(json_object_get(val, "result"),
+						&new_block);
+			if (new_block)
+				applog(LOG_INFO, "LONGPOLL detected new block");
+			else if (opt_debug)
+				applog(LOG_DEBUG, "DBG: LONGPOLL got new transactions");
+
+			/*
+			 * The reply is the new work, hand it out right away.
+			 * After a new block the queued work is stale, fetch
+			 * it again.
+			 */
+			pthread_mutex_lock(&g_work_lock);
+			if (new_block) {
+				/* what is underway is fetched again */
+				work_gen++;
+				workio_wakeup();
+				flush_work();
+				request_work(mythr, opt_queue);
+			}
+			if (have_gbt)
+				ok = ok && gbt_gen_work(&g_work);
+			else {
+				ok = work_decode(json_object_get(val, "result"),
+						 &g_work);
+				g_work.roll_until = rolltime ?
+						    time(NULL) + rolltime : 0;
+			}
+			if (ok) {
+				time(&g_work_time);
+				g_work_nonce = 0;
+			} else
+				g_work_time = 0;
 			restart_threads();
+			pthread_mutex_unlock(&g_work_lock);
+
+			json_decref(val);
 		} else {
 			if (failures++ < 10) {
 				sleep(30);
@@ -695,8 +2238,118 @@ out:
 	free(hdr_path);
 	free(lp_url);
 	tq_freeze(mythr->q);
-	if (curl)
-		curl_easy_cleanup(curl);
+	json_rpc_req_free(lp_req);
+
+	return NULL;
+}
+
+/* log the result of a share submitted over Stratum */
+static void stratum_share_result(const char *s)
+{
+	json_error_t err = { };
+	json_t *val, *res_val, *err_val;
+
+	val = JSON_LOADS(s, &err);
+	if (!val) {
+		applog(LOG_ERR, "JSON decode failed(%d): %s", err.line, err.text);
+		return;
+	}
+
+	/* the replies to mining.submit have the id 4 */
+	if (json_integer_value(json_object_get(val, "id")) == 4) {
+		res_val = json_object_get(val, "result");
+		err_val = json_object_get(val, "error");
+
+		applog(LOG_INFO, "PROOF OF WORK RESULT: %s",
+		       json_is_true(res_val) ? "true (yay!!!)" :
+					       "false (booooo)");
+		if (!json_is_true(res_val) && err_val &&
+		    !json_is_null(err_val)) {
+			char *reason = json_dumps(err_val, 0);
+
+			applog(LOG_INFO, "reject reason: %s", reason);
+			free(reason);
+		}
+	}
+
+	json_decref(val);
+}
+
+static void *stratum_thread(void *userdata)
+{
+	struct thr_info *mythr = userdata;
+	char *last_job_id = NULL;
+	char *s;
+
+	stratum.url = tq_pop(mythr->q, NULL);
+	if (!stratum.url)
+		goto out;
+	applog(LOG_INFO, "Starting Stratum on %s", stratum.url);
+
+	while (1) {
+		int failures = 0;
+
+		while (!stratum.curl) {
+			if (stratum_connect(&stratum, stratum.url) &&
+			    stratum_subscribe(&stratum) &&
+			    stratum_authorize(&stratum, rpc_user, rpc_pass))
+				break;
+
+			stratum_disconnect(&stratum);
+			if (opt_retries >= 0 && ++failures > opt_retries) {
+				applog(LOG_ERR, "...terminating workio thread");
+				workio_stop();
+				goto out;
+			}
+			applog(LOG_ERR, "...retry after %d seconds",
+			       opt_fail_pause);
+			sleep(opt_fail_pause);
+		}
+
+		/* a new job makes the current work stale */
+		pthread_mutex_lock(&g_work_lock);
+		pthread_mutex_lock(&stratum.work_lock);
+		if (stratum.job.job_id && (!last_job_id ||
+		    strcmp(stratum.job.job_id, last_job_id))) {
+			free(last_job_id);
+			last_job_id = strdup(stratum.job.job_id);
+			g_work_time = 0;
+			if (stratum.job.clean) {
+				applog(LOG_INFO, "Stratum detected new block");
+				restart_threads();
+			}
+		}
+		pthread_mutex_unlock(&stratum.work_lock);
+		pthread_mutex_unlock(&g_work_lock);
+
+		if (!stratum_socket_full(&stratum, 120)) {
+			applog(LOG_ERR, "Stratum connection timed out");
+			s = NULL;
+		} else
+			s = stratum_recv_line(&stratum);
+		if (!s) {
+			stratum_disconnect(&stratum);
+			applog(LOG_ERR, "Stratum connection interrupted");
+
+			/* the job may not outlive the session, wait for a new one */
+			pthread_mutex_lock(&g_work_lock);
+			pthread_mutex_lock(&stratum.work_lock);
+			free(stratum.job.job_id);
+			stratum.job.job_id = NULL;
+			pthread_mutex_unlock(&stratum.work_lock);
+			g_work_time = 0;
+			restart_threads();
+			pthread_mutex_unlock(&g_work_lock);
+			continue;
+		}
+		if (!stratum_handle_method(&stratum, s))
+			stratum_share_result(s);
+		free(s);
+	}
+
+out:
+	free(last_job_id);
+	tq_freeze(mythr->q);
 
 	return NULL;
 }
@@ -795,7 +2448,8 @@ static void parse_arg (int key, char *arg)
 		break;
 	case 1001:			/* --url */
 		if (strncmp(arg, "http://", 7) &&
-		    strncmp(arg, "https://", 8))
+		    strncmp(arg, "https://", 8) &&
+		    strncasecmp(arg, "stratum+tcp://", 14))
 			show_usage();
 
 		free(rpc_url);
@@ -814,6 +2468,75 @@ static void parse_arg (int key, char *arg)
 	case 1004:
 		use_syslog = true;
 		break;
+	case 1005: {			/* --kernel */
+		const struct scrypt_impl *impl;
+
+		if (!strcmp(arg, "auto")) {
+			opt_autotune = true;
+			break;
+		}
+		impl = scrypt_find_impl(arg);
+		if (!impl) {
+			applog(LOG_ERR, "Unknown scrypt kernel '%s', available:", arg);
+			for (impl = scrypt_impls; impl->name; impl++)
+				applog(LOG_ERR, "    %s", impl->name);
+			show_usage();
+		}
+		scrypt_impl = impl;
+		opt_autotune = false;
+		break;
+	}
+	case 1006:			/* --lookup-gap */
+		v = atoi(arg);
+		if (v < 1 || v > SCRYPT_MAX_LOOKUP_GAP)	/* sanity check */
+			show_usage();
+
+		opt_lookup_gap = v;
+		opt_lookup_gap_set = true;
+		break;
+	case 1007:			/* --max-memory */
+		v = atoi(arg);
+		if (v < 1)	/* sanity check */
+			show_usage();
+
+		opt_max_memory = v;
+		break;
+	case 1008:
+		opt_huge_pages = false;
+		break;
+	case 1009:
+		opt_lock_memory = true;
+		break;
+	case 1010:
+		opt_numa = false;
+		break;
+	case 1011:
+		opt_sha_ni = false;
+		break;
+	case 1012:			/* --queue */
+		v = atoi(arg);
+		if (v < 0 || v > 9999)	/* sanity check */
+			show_usage();
+
+		opt_queue = v;
+		break;
+	case 1014:			/* --timeout */
+		v = atoi(arg);
+		if (v < 1 || v > 9999)	/* sanity check */
+			show_usage();
+
+		opt_timeout = v;
+		break;
+	case 1013:			/* --coinbase-addr */
+		/* the chain is only known from the daemon, later */
+		if (!address_to_script(gbt_pk_script, sizeof(gbt_pk_script),
+				       arg, NULL)) {
+			applog(LOG_ERR, "Invalid coinbase address '%s'", arg);
+			show_usage();
+		}
+		free(opt_coinbase_addr);
+		opt_coinbase_addr = strdup(arg);
+		break;
 	default:
 		show_usage();
 	}
@@ -903,6 +2626,26 @@ int main (int argc, char *argv[])
 		sprintf(rpc_userpass, "%s:%s", rpc_user, rpc_pass);
 	}
 
+	/* Stratum sends the user name and the password apart */
+	have_stratum = !strncasecmp(rpc_url, "stratum+tcp://", 14);
+	if (have_stratum && (!rpc_user || !rpc_pass)) {
+		char *colon = strchr(rpc_userpass, ':');
+
+		free(rpc_user);
+		free(rpc_pass);
+		if (colon) {
+			rpc_user = strndup(rpc_userpass, colon - rpc_userpass);
+			rpc_pass = strdup(colon + 1);
+		} else {
+			rpc_user = strdup(rpc_userpass);
+			rpc_pass = strdup("");
+		}
+		if (!rpc_user || !rpc_pass)
+			return 1;
+	}
+
+	have_gbt = opt_coinbase_addr && !have_stratum;
+
 	pthread_mutex_init(&time_lock, NULL);
 
 #ifdef HAVE_SYSLOG_H
@@ -913,11 +2656,62 @@ int main (int argc, char *argv[])
 	if (posix_memalign((void **)&work_restart, 128,
 			   sizeof(*work_restart) * opt_n_threads))
 		return 1;
+	memset(work_restart, 0, sizeof(*work_restart) * opt_n_threads);
+
+	scrypt_sha256_use_shani(opt_sha_ni);
+
+	/* SPU threads have their own code, only the rest needs tuning */
+	if (opt_autotune && opt_n_threads > num_cell_spu)
+		autotune_scrypt(opt_n_threads - num_cell_spu);
+	else
+		opt_lookup_gap = scrypt_lookup_gap(scrypt_impl->lanes);
+	if (!opt_lookup_gap) {
+		applog(LOG_ERR, "scrypt kernel '%s' does not fit in %lu KiB",
+		       scrypt_impl->name, opt_max_memory);
+		return 1;
+	}
+	applog(LOG_INFO, "Using scrypt kernel '%s' with lookup gap %d%s",
+	       scrypt_impl->name, opt_lookup_gap,
+	       opt_sha_ni && scrypt_sha256_shani_usable() ? " and SHA-NI" : "");
+
+	thr_info = calloc(opt_n_threads + 3, sizeof(*thr));
+	thr_hashrates = calloc(opt_n_threads, sizeof(*thr_hashrates));
+	if (!thr_info || !thr_hashrates)
+		return 1;
+	if (opt_numa)
+		numa_init();
 
-	thr_info = calloc(opt_n_threads + 2, sizeof(*thr));
-	if (!thr_info)
+	work_q = tq_new();
+	if (!work_q)
 		return 1;
 
+	curl_global_init(CURL_GLOBAL_ALL);
+	workio_multi = curl_multi_init();
+	if (!workio_multi)
+		return 1;
+	curl_multi_setopt(workio_multi, CURLMOPT_MAX_HOST_CONNECTIONS,
+			  (long) WORKIO_MAX_CONNS);
+	curl_multi_setopt(workio_multi, CURLMOPT_MAXCONNECTS,
+			  (long) WORKIO_MAX_CONNS);
+
+	/* an address of another chain would lose the blocks */
+	if (have_gbt) {
+		char *chain = gbt_get_chain();
+
+		if (!chain)
+			return 1;
+		gbt_pk_script_size = address_to_script(gbt_pk_script,
+				sizeof(gbt_pk_script), opt_coinbase_addr, chain);
+		if (!gbt_pk_script_size) {
+			applog(LOG_ERR, "Coinbase address '%s' is not for "
+			       "the %s chain of the daemon",
+			       opt_coinbase_addr, chain);
+			free(chain);
+			return 1;
+		}
+		free(chain);
+	}
+
 	/* init workio thread info */
 	work_thr_id = opt_n_threads;
 	thr = &thr_info[work_thr_id];
@@ -933,7 +2727,7 @@ int main (int argc, char *argv[])
 	}
 
 	/* init longpoll thread info */
-	if (want_longpoll) {
+	if (want_longpoll && !have_stratum) {
 		longpoll_thr_id = opt_n_threads + 1;
 		thr = &thr_info[longpoll_thr_id];
 		thr->id = longpoll_thr_id;
@@ -949,11 +2743,29 @@ int main (int argc, char *argv[])
 	} else
 		longpoll_thr_id = -1;
 
+	/* init stratum thread info */
+	if (have_stratum) {
+		stratum_thr_id = opt_n_threads + 2;
+		thr = &thr_info[stratum_thr_id];
+		thr->id = stratum_thr_id;
+		thr->q = tq_new();
+		if (!thr->q)
+			return 1;
+
+		/* start stratum thread */
+		if (unlikely(pthread_create(&thr->pth, NULL, stratum_thread, thr))) {
+			applog(LOG_ERR, "stratum thread create failed");
+			return 1;
+		}
+		tq_push(thr_info[stratum_thr_id].q, strdup(rpc_url));
+	}
+
 	/* start mining threads */
 	for (i = 0; i < opt_n_threads; i++) {
 		thr = &thr_info[i];
 
 		thr->id = i;
+		thr->node = -1;
 		thr->q = tq_new();
 		if (!thr->q)
 			return 1;
@@ -79,6 +79,12 @@ enum {
 };
 #endif
 
+#if JANSSON_MAJOR_VERSION >= 2
+#define JSON_LOADS(str, err_ptr) json_loads((str), 0, (err_ptr))
+#else
+#define JSON_LOADS(str, err_ptr) json_loads((str), (err_ptr))
+#endif
+
 #undef unlikely
 #undef likely
 #if defined(__GNUC__) && (__GNUC__ > 2) && defined(__OPTIMIZE__)
@@ -95,6 +101,7 @@ enum {
 
 struct thr_info {
 	int		id;
+	int		node;		/* NUMA node, -1 if not bound */
 	pthread_t	pth;
 #ifdef HAVE_CELL_SPU
 	spe_context_ptr_t spe_context;
@@ -129,23 +136,143 @@ static inline void swap256(void *dest_p, const void *src_p)
 extern bool opt_debug;
 extern bool opt_protocol;
 extern const uint32_t sha256_init_state[];
-extern json_t *json_rpc_call(CURL *curl, const char *url, const char *userpass,
-			     const char *rpc_req, bool, bool);
+struct json_rpc_req;
+extern struct json_rpc_req *json_rpc_req_new(const char *url,
+					     const char *userpass);
+extern CURL *json_rpc_req_start(struct json_rpc_req *req, const char *rpc_req,
+				bool longpoll_scan, long timeout);
+extern json_t *json_rpc_req_done(struct json_rpc_req *req, CURLcode rc,
+				 int *rolltime);
+extern void json_rpc_req_free(struct json_rpc_req *req);
+extern json_t *json_rpc_call(struct json_rpc_req *req, const char *rpc_req,
+			     bool, bool, int *rolltime);
 extern char *bin2hex(const unsigned char *p, size_t len);
 extern bool hex2bin(unsigned char *p, const char *hexstr, size_t len);
+extern size_t address_to_script(unsigned char *out, size_t outsz,
+				const char *addr, const char *chain);
 
+/*
+ * Scan the nonces after the one in the header up to max_nonce. On a share
+ * the header holds its nonce, so the scan can be resumed from there.
+ */
 extern int scanhash_scrypt(int, unsigned char *pdata, unsigned char *scratchbuf,
 	const unsigned char *ptarget,
 	uint32_t max_nonce, unsigned long *nHashesDone);
+extern bool scrypt_fulltest(const unsigned char *pdata,
+	unsigned char *scratchbuf, const unsigned char *ptarget);
+
+/*
+ * Every hash processed at once needs its own scratchpad, which is 128 KiB
+ * with the lookup gap 1 and shrinks proportionally to the gap. The rest is
+ * for the alignment, the X block and the cache coloring between hashes.
+ */
+#define SCRYPT_SCRATCHBUF_SIZE(lanes, gap) \
+	((511 + 128 * ((1024 + (gap) - 1) / (gap))) * (lanes))
+#define SCRYPT_MAX_LOOKUP_GAP 1024
+
+extern int opt_lookup_gap;
+
+struct PBKDF2Context;
+
+/*
+ * A scrypt kernel hashes 'lanes' headers at once into the scratchpad of
+ * SCRYPT_SCRATCHBUF_SIZE(lanes, opt_lookup_gap) bytes. Only word 7 of an
+ * output is valid unless it is at most Htarg.
+ */
+typedef void (*scrypt_hash_fn)(const struct PBKDF2Context *ctx,
+			       const uint32_t input[][20],
+			       uint32_t output[][8], uint32_t Htarg,
+			       unsigned char *scratchbuf);
+
+struct scrypt_impl {
+	const char	*name;
+	int		lanes;
+	scrypt_hash_fn	hash;		/* run by the generic scanhash loop */
+	int		(*scanhash)(int, unsigned char *pdata,
+				    unsigned char *scratchbuf,
+				    const unsigned char *ptarget,
+				    uint32_t max_nonce,
+				    unsigned long *nHashesDone);
+					/* for kernels with their own loop */
+};
+
+extern const struct scrypt_impl scrypt_impls[];
+extern const struct scrypt_impl *scrypt_impl;
+extern const struct scrypt_impl *scrypt_find_impl(const char *name);
+extern int scrypt_impl_scanhash(const struct scrypt_impl *impl, int thr_id,
+	unsigned char *pdata, unsigned char *scratchbuf,
+	const unsigned char *ptarget,
+	uint32_t max_nonce, unsigned long *nHashesDone);
+extern bool scrypt_sha256_shani_usable(void);
+extern void scrypt_sha256_use_shani(bool enable);
 
 extern int
 timeval_subtract (struct timeval *result, struct timeval *x, struct timeval *y);
 
+struct scratchbuf {
+	unsigned char	*buf;
+	size_t		size;		/* allocated size */
+	const char	*backing;	/* kind of pages, for the log */
+	bool		locked;
+};
+
+extern bool scratchbuf_alloc(struct scratchbuf *sb, size_t size, bool huge,
+			     bool lock);
+extern void scratchbuf_free(struct scratchbuf *sb);
+
 extern bool fulltest(const unsigned char *hash, const unsigned char *target);
+extern void sha256d(unsigned char *hash, const unsigned char *data, int len);
+
+struct stratum_job {
+	char		*job_id;
+	unsigned char	prevhash[32];
+	size_t		coinbase_size;
+	unsigned char	*coinbase;	/* with room for the extranonces */
+	unsigned char	*xnonce2;	/* points into the coinbase */
+	int		merkle_count;
+	unsigned char	**merkle;
+	unsigned char	version[4];
+	unsigned char	nbits[4];
+	unsigned char	ntime[4];
+	bool		clean;
+	double		diff;
+};
+
+struct stratum_ctx {
+	char		*url;
+
+	CURL		*curl;
+	char		*curl_url;
+	char		curl_err_str[CURL_ERROR_SIZE];
+	curl_socket_t	sock;
+	size_t		sockbuf_size;
+	char		*sockbuf;
+	pthread_mutex_t	sock_lock;
+
+	double		next_diff;
+
+	char		*session_id;
+	size_t		xnonce1_size;
+	unsigned char	*xnonce1;
+	size_t		xnonce2_size;
+	struct stratum_job job;
+	pthread_mutex_t	work_lock;
+};
+
+extern bool stratum_send_line(struct stratum_ctx *sctx, char *s);
+extern bool stratum_socket_full(struct stratum_ctx *sctx, int timeout);
+extern char *stratum_recv_line(struct stratum_ctx *sctx);
+extern bool stratum_connect(struct stratum_ctx *sctx, const char *url);
+extern void stratum_disconnect(struct stratum_ctx *sctx);
+extern bool stratum_subscribe(struct stratum_ctx *sctx);
+extern bool stratum_authorize(struct stratum_ctx *sctx, const char *user,
+			      const char *pass);
+extern bool stratum_handle_method(struct stratum_ctx *sctx, const char *s);
 
 extern int opt_scantime;
 extern bool want_longpoll;
 extern bool have_longpoll;
+extern bool have_stratum;
 struct thread_q;
 
 struct work_restart {
@@ -157,6 +284,7 @@ extern pthread_mutex_t time_lock;
 extern bool use_syslog;
 extern struct thr_info *thr_info;
 extern int longpoll_thr_id;
+extern int stratum_thr_id;
 extern struct work_restart *work_restart;
 
 extern void applog(int prio, const char *fmt, ...);
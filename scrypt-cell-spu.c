@@ -380,69 +380,37 @@ scrypt_spu_core8(uint32_t *databuf32, uint64_t scratch)
 }
 
 static void
-scrypt_1024_1_1_256_sp8(const uint32_t * input1,
-                        uint32_t       * output1,
-                        const uint32_t * input2,
-                        uint32_t       * output2,
-                        const uint32_t * input3,
-                        uint32_t       * output3,
-                        const uint32_t * input4,
-                        uint32_t       * output4,
-                        const uint32_t * input5,
-                        uint32_t       * output5,
-                        const uint32_t * input6,
-                        uint32_t       * output6,
-                        const uint32_t * input7,
-                        uint32_t       * output7,
-                        const uint32_t * input8,
-                        uint32_t       * output8,
-                        uint64_t              scratchpad)
+scrypt_1024_1_1_256_sp8(const PBKDF2_SHA256_80_CTX * ctx,
+                        const uint32_t   input[8][20],
+                        uint32_t         output[8][8],
+                        uint32_t         Htarg,
+                        uint64_t         scratchpad)
 {
-	uint32_t tstate1[8], tstate2[8], tstate3[8], tstate4[8];
-	uint32_t tstate5[8], tstate6[8], tstate7[8], tstate8[8];
-
-	uint32_t ostate1[8], ostate2[8], ostate3[8], ostate4[8];
-	uint32_t ostate5[8], ostate6[8], ostate7[8], ostate8[8];
-	
 	static uint32_t databuf[32 * 8] __attribute__((aligned(128)));
-	uint32_t * B1, * B2, * B3, * B4, * B5, * B6, * B7, * B8;
-
-	B1 = databuf;
-	B2 = databuf + 32 * 1;
-	B3 = databuf + 32 * 2;
-	B4 = databuf + 32 * 3;
-	B5 = databuf + 32 * 4;
-	B6 = databuf + 32 * 5;
-	B7 = databuf + 32 * 6;
-	B8 = databuf + 32 * 7;
-
-	PBKDF2_SHA256_80_128_init(input1, tstate1, ostate1);
-	PBKDF2_SHA256_80_128_init(input2, tstate2, ostate2);
-	PBKDF2_SHA256_80_128_init(input3, tstate3, ostate3);
-	PBKDF2_SHA256_80_128_init(input4, tstate4, ostate4);
-	PBKDF2_SHA256_80_128_init(input5, tstate5, ostate5);
-	PBKDF2_SHA256_80_128_init(input6, tstate6, ostate6);
-	PBKDF2_SHA256_80_128_init(input7, tstate7, ostate7);
-	PBKDF2_SHA256_80_128_init(input8, tstate8, ostate8);
-	PBKDF2_SHA256_80_128(tstate1, ostate1, input1, B1);
-	PBKDF2_SHA256_80_128(tstate2, ostate2, input2, B2);
-	PBKDF2_SHA256_80_128(tstate3, ostate3, input3, B3);
-	PBKDF2_SHA256_80_128(tstate4, ostate4, input4, B4);
-	PBKDF2_SHA256_80_128(tstate5, ostate5, input5, B5);
-	PBKDF2_SHA256_80_128(tstate6, ostate6, input6, B6);
-	PBKDF2_SHA256_80_128(tstate7, ostate7, input7, B7);
-	PBKDF2_SHA256_80_128(tstate8, ostate8, input8, B8);
+	uint32x4 tstate[2][8], ostate[2][8];
+	const uint32_t * in[8], * salt[8];
+	uint32_t * out[8], * B[8];
+	int k;
+
+	for (k = 0; k < 8; k++) {
+		in[k] = input[k];
+		out[k] = output[k];
+		salt[k] = B[k] = databuf + 32 * k;
+	}
+
+	/* PBKDF2 goes in two passes of four lanes */
+	for (k = 0; k < 2; k++) {
+		PBKDF2_SHA256_80_128_init_4way(ctx, &in[k * 4],
+		                               tstate[k], ostate[k]);
+		PBKDF2_SHA256_80_128_4way(ctx, tstate[k], ostate[k],
+		                          &in[k * 4], &B[k * 4]);
+	}
 
 	scrypt_spu_core8(databuf, scratchpad);
 
-	PBKDF2_SHA256_80_128_32(tstate1, ostate1, input1, B1, output1);
-	PBKDF2_SHA256_80_128_32(tstate2, ostate2, input2, B2, output2);
-	PBKDF2_SHA256_80_128_32(tstate3, ostate3, input3, B3, output3);
-	PBKDF2_SHA256_80_128_32(tstate4, ostate4, input4, B4, output4);
-	PBKDF2_SHA256_80_128_32(tstate5, ostate5, input5, B5, output5);
-	PBKDF2_SHA256_80_128_32(tstate6, ostate6, input6, B6, output6);
-	PBKDF2_SHA256_80_128_32(tstate7, ostate7, input7, B7, output7);
-	PBKDF2_SHA256_80_128_32(tstate8, ostate8, input8, B8, output8);
+	for (k = 0; k < 2; k++)
+		PBKDF2_SHA256_80_128_32_4way(ctx, tstate[k], ostate[k],
+		                             &salt[k * 4], &out[k * 4], Htarg);
 }
 
 static int
@@ -450,118 +418,53 @@ scanhash_scrypt(uint64_t work_restart_ptr, unsigned char *pdata,
 	uint64_t scratchbuf, const unsigned char *ptarget,
 	uint32_t max_nonce, uint32_t *hashes_done)
 {
-	uint32_t data1[20], tmp_hash1[8];
-	uint32_t data2[20], tmp_hash2[8];
-	uint32_t data3[20], tmp_hash3[8];
-	uint32_t data4[20], tmp_hash4[8];
-	uint32_t data5[20], tmp_hash5[8];
-	uint32_t data6[20], tmp_hash6[8];
-	uint32_t data7[20], tmp_hash7[8];
-	uint32_t data8[20], tmp_hash8[8];
-	uint32_t *nonce1 = &data1[19];
-	uint32_t *nonce2 = &data2[19];
-	uint32_t *nonce3 = &data3[19];
-	uint32_t *nonce4 = &data4[19];
-	uint32_t *nonce5 = &data5[19];
-	uint32_t *nonce6 = &data6[19];
-	uint32_t *nonce7 = &data7[19];
-	uint32_t *nonce8 = &data8[19];
-	uint32_t n = 0;
+	PBKDF2_SHA256_80_CTX ctx;
+	uint32_t data[8][20], tmp_hash[8][8];
+	uint32_t first_nonce = be32dec(pdata + 64 + 12);
+	uint32_t n = first_nonce;
 	uint32_t Htarg = le32dec(ptarget + 28);
-	int i;
+	int i, k;
 	int tag3 = 3, tag_mask3 = 1 << tag3;
 	int work_restart = 0;
 
 	for (i = 0; i < 80/4; i++) {
-		data1[i] = be32dec(&((uint32_t *)pdata)[i]);
-		data2[i] = be32dec(&((uint32_t *)pdata)[i]);
-		data3[i] = be32dec(&((uint32_t *)pdata)[i]);
-		data4[i] = be32dec(&((uint32_t *)pdata)[i]);
-		data5[i] = be32dec(&((uint32_t *)pdata)[i]);
-		data6[i] = be32dec(&((uint32_t *)pdata)[i]);
-		data7[i] = be32dec(&((uint32_t *)pdata)[i]);
-		data8[i] = be32dec(&((uint32_t *)pdata)[i]);
+		uint32_t w = be32dec(&((uint32_t *)pdata)[i]);
+		for (k = 0; k < 8; k++)
+			data[k][i] = w;
 	}
+	PBKDF2_SHA256_80_precalc(data[0], &ctx);
 	
 	while(1) {
 		/* request 'work_restart[thr_id].restart' from external memory */
 		mfc_get(&work_restart, work_restart_ptr, 4, tag3, 0, 0);
 
-		*nonce1 = n + 1;
-		*nonce2 = n + 2;
-		*nonce3 = n + 3;
-		*nonce4 = n + 4;
-		*nonce5 = n + 5;
-		*nonce6 = n + 6;
-		*nonce7 = n + 7;
-		*nonce8 = n + 8;
-		scrypt_1024_1_1_256_sp8(data1, tmp_hash1, data2, tmp_hash2,
-		                        data3, tmp_hash3, data4, tmp_hash4,
-		                        data5, tmp_hash5, data6, tmp_hash6,
-		                        data7, tmp_hash7, data8, tmp_hash8,
-		                        scratchbuf);
-
-		if (tmp_hash1[7] <= Htarg) {
-			be32enc(pdata + 64 + 12, n + 1);
-			*hashes_done = n;
-			return true;
-		}
-
-		if (tmp_hash2[7] <= Htarg && n + 2 <= max_nonce) {
-			be32enc(pdata + 64 + 12, n + 2);
-			*hashes_done = n + 2;
-			return true;
-		}
-
-		if (tmp_hash3[7] <= Htarg && n + 3 <= max_nonce) {
-			be32enc(pdata + 64 + 12, n + 3);
-			*hashes_done = n + 3;
-			return true;
-		}
-
-		if (tmp_hash4[7] <= Htarg && n + 4 <= max_nonce) {
-			be32enc(pdata + 64 + 12, n + 4);
-			*hashes_done = n + 4;
-			return true;
-		}
-
-		if (tmp_hash5[7] <= Htarg && n + 5 <= max_nonce) {
-			be32enc(pdata + 64 + 12, n + 5);
-			*hashes_done = n + 5;
-			return true;
-		}
-
-		if (tmp_hash6[7] <= Htarg && n + 6 <= max_nonce) {
-			be32enc(pdata + 64 + 12, n + 6);
-			*hashes_done = n + 6;
-			return true;
-		}
+		for (k = 0; k < 8; k++)
+			data[k][19] = n + k + 1;
+		scrypt_1024_1_1_256_sp8(&ctx, (const uint32_t (*)[20])data,
+		                        tmp_hash, Htarg, scratchbuf);
 
-		if (tmp_hash7[7] <= Htarg && n + 7 <= max_nonce) {
-			be32enc(pdata + 64 + 12, n + 7);
-			*hashes_done = n + 7;
-			return true;
+		for (k = 0; k < 8 && (uint32_t)k < max_nonce - n; k++) {
+			if (tmp_hash[k][7] <= Htarg) {
+				be32enc(pdata + 64 + 12, n + k + 1);
+				*hashes_done = n + k + 1 - first_nonce;
+				return true;
+			}
 		}
 
-		if (tmp_hash8[7] <= Htarg && n + 8 <= max_nonce) {
-			be32enc(pdata + 64 + 12, n + 8);
-			*hashes_done = n + 8;
-			return true;
+		/* so that 'n' cannot wrap around near the top of the range */
+		if (max_nonce - n <= 8) {
+			*hashes_done = max_nonce - first_nonce;
+			break;
 		}
 
 		n += 8;
 
-		if (n >= max_nonce) {
-			*hashes_done = max_nonce;
-			break;
-		}
-
 		/* ensure that 'work_restart[thr_id].restart' has been read */
 		mfc_write_tag_mask(tag_mask3);
 		mfc_read_tag_status_all();
 
 		if (work_restart) {
-			*hashes_done = n;
+			*hashes_done = n - first_nonce;
 			break;
 		}
 	}
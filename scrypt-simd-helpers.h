@@ -75,7 +75,7 @@ typedef uint32_t uint32x4 __attribute__ ((vector_size(16), aligned(16)));
 typedef uint8_t uint8x16 __attribute__ ((vector_size(16), aligned(16)));
 
 /*
- * Define two helper functions ('rol_32x4' and 'shuffle_32x4') to ensure
+ * Define helper functions ('rol_32x4', 'shr_32x4' and 'shuffle_32x4') to ensure
  * better support for old gcc versions and gcc-compatible compilers
  */
 static inline __attribute__((always_inline)) uint32x4
@@ -93,6 +93,20 @@ rol_32x4(uint32x4 a, uint32_t b)
 #endif
 }
 
+static inline __attribute__((always_inline)) uint32x4
+shr_32x4(uint32x4 a, uint32_t b)
+{
+#ifdef __ALTIVEC__
+	return vec_sr(a, vec_splats(b));
+#elif defined(__SPU__)
+	return spu_rlmask(a, -(int)b);
+#elif defined(__SSE2__)
+	return (uint32x4)_mm_srli_epi32((__m128i)a, b);
+#else
+	return a >> b;
+#endif
+}
+
 #if defined(__clang__)
 # define shuffle_32x4(a, p1, p2, p3, p4) \
 	__builtin_shufflevector(a, a, p1, p2, p3, p4)
@@ -258,6 +272,51 @@ salsa20_8_xor2(uint32x4 * __restrict B, const uint32x4 * __restrict Bx,
 /* Helps to prevent the violation of strict aliasing rules */
 typedef union { uint32x4 q[8]; uint32_t w[32]; } XY;
 
+/*
+ * Number of V entries which are actually stored for each hash. With a
+ * lookup gap, only every gap-th entry is kept and the others are
+ * recomputed from it when needed ("time-memory tradeoff").
+ */
+#define SCRYPT_V_ENTRIES(gap) ((1024 + (gap) - 1) / (gap))
+
+/*
+ * Padding between the V regions of the hashes which are processed
+ * together, in 128 byte blocks. Without it, the regions are a multiple of
+ * the cache way size apart and the same V entry of every hash maps to the
+ * same cache set. This matters the most for the first loop, which writes
+ * the same entry for all the hashes at once.
+ */
+#ifndef SCRYPT_LANE_COLOR
+#define SCRYPT_LANE_COLOR 1
+#endif
+
+#if SCRYPT_LANE_COLOR > 2
+#error SCRYPT_SCRATCHBUF_SIZE has room for at most 2 blocks of lane color
+#endif
+
+/* Distance between the V regions of two hashes, in 128 byte blocks */
+#define SCRYPT_V_STRIDE(gap) (SCRYPT_V_ENTRIES(gap) + SCRYPT_LANE_COLOR)
+
+/*
+ * Get V[j] for a single hash. If it is not stored, recompute it in Y from
+ * the closest stored entry before it.
+ */
+static inline __attribute__((always_inline)) const uint32x4 *
+scrypt_simd_lookup(XY * __restrict Y, const uint32x4 * V, int j, int gap)
+{
+	int k = j % gap;
+
+	if (!k)
+		return &V[(j / gap) * 8];
+
+	blkcpy128(Y->q, &V[(j / gap) * 8]);
+	while (k--) {
+		salsa20_8_xor(&Y->q[0], &Y->q[4]);
+		salsa20_8_xor(&Y->q[4], &Y->q[0]);
+	}
+	return Y->q;
+}
+
 /**
  * The most performance critical part of scrypt (N = 1024, r = 1, p = 1).
  * Handles one hash at a time. Is likely the best choice when having
@@ -265,16 +324,18 @@ typedef union { uint32x4 q[8]; uint32_t w[32]; } XY;
  *
  * databuf - 128 bytes buffer for data input and output
  * scratch - temporary buffer, it must have size at
- *           least (128 + 128 * 1024) bytes
+ *           least (128 + 128 * SCRYPT_V_ENTRIES(gap)) bytes
+ * gap     - lookup gap, only every gap-th V entry is stored
  *
  * All buffers must be aligned at 64 byte boundary.
  */
 static inline
-void scrypt_simd_core1(uint32_t databuf[32], void * scratch)
+void scrypt_simd_core1(uint32_t databuf[32], void * scratch, int gap)
 {
 	uint32_t * databufA = (uint32_t *)&databuf[0];
 	XY       * X = (XY *)((uintptr_t)scratch + 0);
 	uint32x4 * V = (uint32x4 *)((uintptr_t)scratch + 128);
+	XY         Y;
 	int i, j;
 
 	/* 1: X <-- B */
@@ -285,7 +346,8 @@ void scrypt_simd_core1(uint32_t databuf[32], void * scratch)
 
 	/* 2: for i = 0 to N - 1 do */
 	for (i = 0; i < 1024; i++) {
-		blkcpy128(&V[i * 8], &X->q[0]);
+		if (i % gap == 0)
+			blkcpy128(&V[(i / gap) * 8], &X->q[0]);
 		salsa20_8_xor(&X->q[0], &X->q[4]);
 		salsa20_8_xor(&X->q[4], &X->q[0]);
 	}
@@ -293,7 +355,7 @@ void scrypt_simd_core1(uint32_t databuf[32], void * scratch)
 	/* 6: for i = 0 to N - 1 do */
 	for (i = 0; i < 1024; i++) {
 		j = X->w[16] & 1023; /* j <-- Integerify(X) mod N */
-		blkxor128(X->q, &V[j * 8]);
+		blkxor128(X->q, scrypt_simd_lookup(&Y, V, j, gap));
 		salsa20_8_xor(&X->q[0], &X->q[4]);
 		salsa20_8_xor(&X->q[4], &X->q[0]);
 	}
@@ -313,19 +375,21 @@ void scrypt_simd_core1(uint32_t databuf[32], void * scratch)
  *
  * databuf - two 128 bytes buffer for data input and output
  * scratch - temporary buffer, it must have size at
- *           least (2 * 128 + 2 * 128 * 1024) bytes
+ *           least (2 * 128 + 2 * 128 * SCRYPT_V_STRIDE(gap)) bytes
+ * gap     - lookup gap, only every gap-th V entry is stored
  *
  * All buffers must be aligned at 64 byte boundary.
  */
 static inline
-void scrypt_simd_core2(uint32_t databuf[2 * 32], void * scratch)
+void scrypt_simd_core2(uint32_t databuf[2 * 32], void * scratch, int gap)
 {
 	uint32_t * databufA = (uint32_t *)&databuf[0];
 	uint32_t * databufB = (uint32_t *)&databuf[32];
 	XY       * XA = (XY *)((uintptr_t)scratch);
-	XY       * XB = (XY *)((uintptr_t)scratch + 128 + 128 * 1024);
+	XY       * XB = (XY *)((uintptr_t)scratch + 128 + 128 * SCRYPT_V_STRIDE(gap));
 	uint32x4 * VA = (uint32x4 *)((uintptr_t)XA + 128);
 	uint32x4 * VB = (uint32x4 *)((uintptr_t)XB + 128);
+	XY         YA, YB;
 	int i, jA, jB;
 
 	/* 1: X <-- B */
@@ -338,8 +402,10 @@ void scrypt_simd_core2(uint32_t databuf[2 * 32], void * scratch)
 
 	/* 2: for i = 0 to N - 1 do */
 	for (i = 0; i < 1024; i++) {
-		blkcpy128(&VA[i * 8], &XA->q[0]);
-		blkcpy128(&VB[i * 8], &XB->q[0]);
+		if (i % gap == 0) {
+			blkcpy128(&VA[(i / gap) * 8], &XA->q[0]);
+			blkcpy128(&VB[(i / gap) * 8], &XB->q[0]);
+		}
 		salsa20_8_xor2(&XA->q[0], &XA->q[4], &XB->q[0], &XB->q[4]);
 		salsa20_8_xor2(&XA->q[4], &XA->q[0], &XB->q[4], &XB->q[0]);
 	}
@@ -348,8 +414,8 @@ void scrypt_simd_core2(uint32_t databuf[2 * 32], void * scratch)
 	for (i = 0; i < 1024; i++) {
 		jA = XA->w[16] & 1023; /* j <-- Integerify(X) mod N */
 		jB = XB->w[16] & 1023; /* j <-- Integerify(X) mod N */
-		blkxor128(XA->q, &VA[jA * 8]);
-		blkxor128(XB->q, &VB[jB * 8]);
+		blkxor128(XA->q, scrypt_simd_lookup(&YA, VA, jA, gap));
+		blkxor128(XB->q, scrypt_simd_lookup(&YB, VB, jB, gap));
 		salsa20_8_xor2(&XA->q[0], &XA->q[4], &XB->q[0], &XB->q[4]);
 		salsa20_8_xor2(&XA->q[4], &XA->q[0], &XB->q[4], &XB->q[0]);
 	}
@@ -363,5 +429,1347 @@ void scrypt_simd_core2(uint32_t databuf[2 * 32], void * scratch)
 	}
 }
 
+/**
+ * Same as 'scrypt_simd_core2', but the two hashes are kept half a hash
+ * apart. The first loop (sequential writes to V) runs for one hash while
+ * the second loop (random reads from V) runs for the other one, which
+ * went through its first loop in the previous call. So the memory
+ * accesses are spread evenly instead of having all the hashes either
+ * computing or waiting for memory at the same time.
+ *
+ * The scratch buffer has two slots and the hash started by one call is
+ * finished by the next call, which uses the other slot.
+ *
+ * start   - 128 bytes buffer with the hash to be started, or NULL
+ * finish  - 128 bytes buffer for the hash to be finished, or NULL
+ * scratch - temporary buffer, it must have size at
+ *           least (2 * 128 + 2 * 128 * SCRYPT_V_STRIDE(gap)) bytes
+ * slot    - slot for the started hash, the other one is being finished
+ * gap     - lookup gap, only every gap-th V entry is stored
+ *
+ * All buffers must be aligned at 64 byte boundary.
+ */
+static inline
+void scrypt_simd_core2_staggered(const uint32_t * start, uint32_t * finish,
+                                 void * scratch, int slot, int gap)
+{
+	uintptr_t  slot_size = 128 + 128 * SCRYPT_V_STRIDE(gap);
+	XY       * XA = (XY *)((uintptr_t)scratch + slot * slot_size);
+	XY       * XB = (XY *)((uintptr_t)scratch + (slot ^ 1) * slot_size);
+	uint32x4 * VA = (uint32x4 *)((uintptr_t)XA + 128);
+	uint32x4 * VB = (uint32x4 *)((uintptr_t)XB + 128);
+	XY         YB;
+	int i, jB;
+
+	/* 1: X <-- B */
+	for (i = 0; start && i < 16; i++) {
+		XA->w[i]      = start[i * 5 % 16];
+		XA->w[16 + i] = start[16 + (i * 5 % 16)];
+	}
+
+	if (start && finish) {
+		/* 2: for i = 0 to N - 1 do, and 6: for i = 0 to N - 1 do */
+		for (i = 0; i < 1024; i++) {
+			if (i % gap == 0)
+				blkcpy128(&VA[(i / gap) * 8], &XA->q[0]);
+			jB = XB->w[16] & 1023; /* j <-- Integerify(X) mod N */
+			blkxor128(XB->q, scrypt_simd_lookup(&YB, VB, jB, gap));
+			salsa20_8_xor2(&XA->q[0], &XA->q[4], &XB->q[0], &XB->q[4]);
+			salsa20_8_xor2(&XA->q[4], &XA->q[0], &XB->q[4], &XB->q[0]);
+		}
+	} else if (start) {
+		/* 2: for i = 0 to N - 1 do */
+		for (i = 0; i < 1024; i++) {
+			if (i % gap == 0)
+				blkcpy128(&VA[(i / gap) * 8], &XA->q[0]);
+			salsa20_8_xor(&XA->q[0], &XA->q[4]);
+			salsa20_8_xor(&XA->q[4], &XA->q[0]);
+		}
+	} else if (finish) {
+		/* 6: for i = 0 to N - 1 do */
+		for (i = 0; i < 1024; i++) {
+			jB = XB->w[16] & 1023; /* j <-- Integerify(X) mod N */
+			blkxor128(XB->q, scrypt_simd_lookup(&YB, VB, jB, gap));
+			salsa20_8_xor(&XB->q[0], &XB->q[4]);
+			salsa20_8_xor(&XB->q[4], &XB->q[0]);
+		}
+	}
+
+	/* 10: B' <-- X */
+	for (i = 0; finish && i < 16; i++) {
+		finish[i * 5 % 16] = XB->w[i];
+		finish[16 + (i * 5 % 16)] = XB->w[16 + i];
+	}
+}
+
+/*****************************************************************************/
+
+/*
+ * Multi-buffer SHA256, used for the PBKDF2 parts of scrypt. Every register
+ * holds the same word of four independent SHA256 states, so all the lanes
+ * of a scrypt kernel go through PBKDF2 in one pass instead of one by one.
+ */
+
+#define S0_32x4(x)	(rol_32x4(x, 30) ^ rol_32x4(x, 19) ^ rol_32x4(x, 10))
+#define S1_32x4(x)	(rol_32x4(x, 26) ^ rol_32x4(x, 21) ^ rol_32x4(x, 7))
+#define s0_32x4(x)	(rol_32x4(x, 25) ^ rol_32x4(x, 14) ^ shr_32x4(x, 3))
+#define s1_32x4(x)	(rol_32x4(x, 15) ^ rol_32x4(x, 13) ^ shr_32x4(x, 10))
+
+#define splat_32x4(x)	((uint32x4){ (x), (x), (x), (x) })
+
+/* Round 'i + j' with the state rotated by 'j' */
+#define RNDr_32x4(S, W, i, j)						\
+	do {								\
+		uint32x4 t0, t1;					\
+		t0 = S[(15 - j) % 8] + S1_32x4(S[(12 - j) % 8]) +	\
+		     Ch(S[(12 - j) % 8], S[(13 - j) % 8],		\
+		        S[(14 - j) % 8]) +				\
+		     W[i + j] + splat_32x4(sha256_k[i + j]);		\
+		t1 = S0_32x4(S[(8 - j) % 8]) +				\
+		     Maj(S[(8 - j) % 8], S[(9 - j) % 8], S[(10 - j) % 8]); \
+		S[(11 - j) % 8] += t0;					\
+		S[(15 - j) % 8] = t0 + t1;				\
+	} while (0)
+
+static inline void
+SHA256_Transform_4way(uint32x4 state[8], const uint32x4 block[16])
+{
+	uint32x4 W[64], S[8];
+	int i;
+
+	for (i = 0; i < 16; i++)
+		W[i] = block[i];
+	for (; i < 64; i++)
+		W[i] = s1_32x4(W[i - 2]) + W[i - 7] +
+		       s0_32x4(W[i - 15]) + W[i - 16];
+
+	for (i = 0; i < 8; i++)
+		S[i] = state[i];
+	for (i = 0; i < 64; i += 8) {
+		RNDr_32x4(S, W, i, 0);
+		RNDr_32x4(S, W, i, 1);
+		RNDr_32x4(S, W, i, 2);
+		RNDr_32x4(S, W, i, 3);
+		RNDr_32x4(S, W, i, 4);
+		RNDr_32x4(S, W, i, 5);
+		RNDr_32x4(S, W, i, 6);
+		RNDr_32x4(S, W, i, 7);
+	}
+	for (i = 0; i < 8; i++)
+		state[i] += S[i];
+}
+
+/* Gather word 'i' of four byteswapped input buffers */
+static inline __attribute__((always_inline)) uint32x4
+load_be_4way(const uint32_t * const p[4], int i)
+{
+	uint32x4 r = {
+		byteswap(p[0][i]), byteswap(p[1][i]),
+		byteswap(p[2][i]), byteswap(p[3][i])
+	};
+	return r;
+}
+
+static inline __attribute__((always_inline)) void
+store_be_4way(uint32_t * const p[4], int i, uint32x4 v)
+{
+	union { uint32x4 q; uint32_t w[4]; } u = { v };
+
+	p[0][i] = byteswap(u.w[0]);
+	p[1][i] = byteswap(u.w[1]);
+	p[2][i] = byteswap(u.w[2]);
+	p[3][i] = byteswap(u.w[3]);
+}
+
+/* Four-way versions of 'SHA256_Schedule' and 'SHA256_Rounds' */
+static inline void
+SHA256_Schedule_4way(uint32x4 W[64], int first)
+{
+	int i;
+
+	for (i = first; i < 64; i++)
+		W[i] = s1_32x4(W[i - 2]) + W[i - 7] +
+		       s0_32x4(W[i - 15]) + W[i - 16];
+}
+
+static inline void
+SHA256_Rounds_4way(uint32x4 S[8], const uint32x4 W[64], int first, int last)
+{
+	uint32x4 a = S[0], b = S[1], c = S[2], d = S[3];
+	uint32x4 e = S[4], f = S[5], g = S[6], h = S[7];
+	uint32x4 t0, t1;
+	int i;
+
+#if !defined(__clang__) && (__GNUC__ >= 8)
+#pragma GCC unroll 64
+#endif
+	for (i = first; i < last; i++) {
+		t0 = h + S1_32x4(e) + Ch(e, f, g) + W[i] +
+		     splat_32x4(sha256_k[i]);
+		t1 = S0_32x4(a) + Maj(a, b, c);
+		h = g; g = f; f = e; e = d + t0;
+		d = c; c = b; b = a; a = t0 + t1;
+	}
+
+	S[0] = a; S[1] = b; S[2] = c; S[3] = d;
+	S[4] = e; S[5] = f; S[6] = g; S[7] = h;
+}
+
+/* Four-way version of 'SHA256_Transform_word7' */
+static inline uint32x4
+SHA256_Transform_word7_4way(const uint32x4 state[8], const uint32x4 block[16])
+{
+	uint32x4 W[64], S[8];
+	int i;
+
+	for (i = 0; i < 16; i++)
+		W[i] = block[i];
+	for (; i < 61; i++)
+		W[i] = s1_32x4(W[i - 2]) + W[i - 7] +
+		       s0_32x4(W[i - 15]) + W[i - 16];
+	for (i = 0; i < 8; i++)
+		S[i] = state[i];
+	SHA256_Rounds_4way(S, W, 0, 61);
+	return state[7] + S[4];
+}
+
+/**
+ * Same as 'PBKDF2_SHA256_80_128_init' for four passwords at once, which
+ * only differ in the nonce, so they share the precomputed parts in 'ctx'.
+ */
+static inline void
+PBKDF2_SHA256_80_128_init_4way(const PBKDF2_SHA256_80_CTX *ctx,
+                               const uint32_t * const passwd[4],
+                               uint32x4 tstate[8], uint32x4 ostate[8])
+{
+	uint32_t init[8];
+	uint32x4 W[64], S[8];
+	uint32x4 ihash[8];
+	uint32x4 pad[16];
+	int i;
+
+	for (i = 0; i < 18; i++)
+		W[i] = splat_32x4(ctx->tailW[i]);
+	W[3] = load_be_4way(passwd, 19);
+	SHA256_Schedule_4way(W, 18);
+	for (i = 0; i < 8; i++)
+		S[i] = splat_32x4(ctx->tailS[i]);
+	SHA256_Rounds_4way(S, W, 3, 64);
+	for (i = 0; i < 8; i++)
+		ihash[i] = splat_32x4(ctx->midstate[i]) + S[i];
+
+	SHA256_InitState(init);
+	for (i = 0; i < 8; i++)
+		ostate[i] = splat_32x4(init[i]);
+	for (i = 0; i < 8; i++)
+		pad[i] = ihash[i] ^ splat_32x4(0x5c5c5c5c);
+	for (; i < 16; i++)
+		pad[i] = splat_32x4(0x5c5c5c5c);
+	SHA256_Transform_4way(ostate, pad);
+
+	for (i = 0; i < 8; i++)
+		tstate[i] = splat_32x4(init[i]);
+	for (i = 0; i < 8; i++)
+		pad[i] = ihash[i] ^ splat_32x4(0x36363636);
+	for (; i < 16; i++)
+		pad[i] = splat_32x4(0x36363636);
+	SHA256_Transform_4way(tstate, pad);
+}
+
+/**
+ * Same as 'PBKDF2_SHA256_80_128' for four passwords at once, the output
+ * of every lane goes to its own 128 bytes buffer.
+ */
+static inline void
+PBKDF2_SHA256_80_128_4way(const PBKDF2_SHA256_80_CTX *ctx,
+                          const uint32x4 tstate[8], const uint32x4 ostate[8],
+                          const uint32_t * const passwd[4],
+                          uint32_t * const buf[4])
+{
+	uint32x4 W[64], S[8], S4[8];
+	uint32x4 ihash[8], obuf[16];
+	int i, k;
+
+	for (i = 0; i < 64; i++)
+		W[i] = splat_32x4(ctx->headW[i]);
+	for (i = 0; i < 8; i++)
+		S[i] = tstate[i];
+	SHA256_Rounds_4way(S, W, 0, 64);
+	for (i = 0; i < 8; i++)
+		ihash[i] = tstate[i] + S[i];
+
+	/* the rounds 0 - 3 are the same for all the blocks */
+	for (i = 0; i < 18; i++)
+		W[i] = splat_32x4(ctx->innerW[i]);
+	W[3] = load_be_4way(passwd, 19);
+	W[18] = s1_32x4(W[16]) + W[11] + s0_32x4(W[3]) + W[2];
+	for (i = 0; i < 8; i++)
+		S4[i] = ihash[i];
+	SHA256_Rounds_4way(S4, W, 0, 4);
+
+	for (i = 0; i < 8; i++)
+		obuf[8 + i] = splat_32x4(outerpad[i]);
+
+	/* Iterate through the blocks. */
+	for (i = 0; i < 4; i++) {
+		uint32x4 ost[8];
+
+		W[4] = splat_32x4(i + 1);
+		SHA256_Schedule_4way(W, 19);
+		for (k = 0; k < 8; k++)
+			S[k] = S4[k];
+		SHA256_Rounds_4way(S, W, 4, 64);
+		for (k = 0; k < 8; k++)
+			obuf[k] = ihash[k] + S[k];
+
+		for (k = 0; k < 8; k++)
+			ost[k] = ostate[k];
+		SHA256_Transform_4way(ost, obuf);
+		for (k = 0; k < 8; k++)
+			store_be_4way(buf, i * 8 + k, ost[k]);
+	}
+}
+
+/**
+ * Same as 'PBKDF2_SHA256_80_128_32' for four salts at once. The whole output
+ * is only computed when word 7 of some lane is not above 'Htarg'.
+ */
+static inline void
+PBKDF2_SHA256_80_128_32_4way(const PBKDF2_SHA256_80_CTX *ctx,
+                             uint32x4 tstate[8], uint32x4 ostate[8],
+                             const uint32_t * const salt[4],
+                             uint32_t * const output[4], uint32_t Htarg)
+{
+	uint32x4 W[64], S[8];
+	uint32x4 pad[16];
+	int i;
+
+	for (i = 0; i < 16; i++)
+		pad[i] = load_be_4way(salt, i);
+	SHA256_Transform_4way(tstate, pad);
+	for (i = 0; i < 16; i++)
+		pad[i] = load_be_4way(salt, 16 + i);
+	SHA256_Transform_4way(tstate, pad);
+	for (i = 0; i < 64; i++)
+		W[i] = splat_32x4(ctx->finalW[i]);
+	for (i = 0; i < 8; i++)
+		S[i] = tstate[i];
+	SHA256_Rounds_4way(S, W, 0, 64);
+
+	for (i = 0; i < 8; i++)
+		pad[i] = tstate[i] + S[i];
+	for (; i < 16; i++)
+		pad[i] = splat_32x4(outerpad[i - 8]);
+
+	store_be_4way(output, 7, SHA256_Transform_word7_4way(ostate, pad));
+	for (i = 0; i < 4 && output[i][7] > Htarg; i++)
+		;
+	if (i == 4)
+		return;
+
+	SHA256_Transform_4way(ostate, pad);
+	for (i = 0; i < 8; i++)
+		store_be_4way(output, i, ostate[i]);
+}
+
+#ifdef __SSE2__
+
+#define HAVE_SCRYPT_SIMD_CORE4
+
+/*
+ * Transpose a 4x4 matrix of 32-bit words. Converts between four words
+ * of a single hash stored in one register and the same word of four
+ * hashes stored in one register.
+ */
+static inline __attribute__((always_inline)) void
+transpose_32x4(uint32x4 D[4], const uint32x4 S[4])
+{
+	__m128i t0, t1, t2, t3;
+
+	t0 = _mm_unpacklo_epi32((__m128i)S[0], (__m128i)S[1]);
+	t1 = _mm_unpackhi_epi32((__m128i)S[0], (__m128i)S[1]);
+	t2 = _mm_unpacklo_epi32((__m128i)S[2], (__m128i)S[3]);
+	t3 = _mm_unpackhi_epi32((__m128i)S[2], (__m128i)S[3]);
+
+	D[0] = (uint32x4)_mm_unpacklo_epi64(t0, t2);
+	D[1] = (uint32x4)_mm_unpackhi_epi64(t0, t2);
+	D[2] = (uint32x4)_mm_unpacklo_epi64(t1, t3);
+	D[3] = (uint32x4)_mm_unpackhi_epi64(t1, t3);
+}
+
+/**
+ * salsa20_8(B):
+ * Apply the salsa20/8 core to four blocks at once. Unlike 'salsa20_8_xor',
+ * each register holds the same word of four independent blocks, so no
+ * shuffles are needed between the column and row rounds.
+ */
+static inline __attribute__((always_inline)) void
+salsa20_8_xor_32x4(uint32x4 * __restrict B, const uint32x4 * __restrict Bx)
+{
+	uint32x4 x00,x01,x02,x03,x04,x05,x06,x07,x08,x09,x10,x11,x12,x13,x14,x15;
+	int i;
+
+	x00 = (B[ 0] ^= Bx[ 0]);
+	x01 = (B[ 1] ^= Bx[ 1]);
+	x02 = (B[ 2] ^= Bx[ 2]);
+	x03 = (B[ 3] ^= Bx[ 3]);
+	x04 = (B[ 4] ^= Bx[ 4]);
+	x05 = (B[ 5] ^= Bx[ 5]);
+	x06 = (B[ 6] ^= Bx[ 6]);
+	x07 = (B[ 7] ^= Bx[ 7]);
+	x08 = (B[ 8] ^= Bx[ 8]);
+	x09 = (B[ 9] ^= Bx[ 9]);
+	x10 = (B[10] ^= Bx[10]);
+	x11 = (B[11] ^= Bx[11]);
+	x12 = (B[12] ^= Bx[12]);
+	x13 = (B[13] ^= Bx[13]);
+	x14 = (B[14] ^= Bx[14]);
+	x15 = (B[15] ^= Bx[15]);
+	for (i = 0; i < 8; i += 2) {
+#define R(a,b) rol_32x4(a, b)
+		/* Operate on columns. */
+		x04 ^= R(x00+x12, 7);	x09 ^= R(x05+x01, 7);	x14 ^= R(x10+x06, 7);	x03 ^= R(x15+x11, 7);
+		x08 ^= R(x04+x00, 9);	x13 ^= R(x09+x05, 9);	x02 ^= R(x14+x10, 9);	x07 ^= R(x03+x15, 9);
+		x12 ^= R(x08+x04,13);	x01 ^= R(x13+x09,13);	x06 ^= R(x02+x14,13);	x11 ^= R(x07+x03,13);
+		x00 ^= R(x12+x08,18);	x05 ^= R(x01+x13,18);	x10 ^= R(x06+x02,18);	x15 ^= R(x11+x07,18);
+
+		/* Operate on rows. */
+		x01 ^= R(x00+x03, 7);	x06 ^= R(x05+x04, 7);	x11 ^= R(x10+x09, 7);	x12 ^= R(x15+x14, 7);
+		x02 ^= R(x01+x00, 9);	x07 ^= R(x06+x05, 9);	x08 ^= R(x11+x10, 9);	x13 ^= R(x12+x15, 9);
+		x03 ^= R(x02+x01,13);	x04 ^= R(x07+x06,13);	x09 ^= R(x08+x11,13);	x14 ^= R(x13+x12,13);
+		x00 ^= R(x03+x02,18);	x05 ^= R(x04+x07,18);	x10 ^= R(x09+x08,18);	x15 ^= R(x14+x13,18);
+#undef R
+	}
+	B[ 0] += x00;
+	B[ 1] += x01;
+	B[ 2] += x02;
+	B[ 3] += x03;
+	B[ 4] += x04;
+	B[ 5] += x05;
+	B[ 6] += x06;
+	B[ 7] += x07;
+	B[ 8] += x08;
+	B[ 9] += x09;
+	B[10] += x10;
+	B[11] += x11;
+	B[12] += x12;
+	B[13] += x13;
+	B[14] += x14;
+	B[15] += x15;
+}
+
+/*
+ * Recompute the V entries which are not stored because of the lookup gap.
+ * Y holds the closest stored entries, and lane l needs r[l] more steps.
+ * All the lanes are advanced together and each one keeps the block from
+ * its own step.
+ */
+static inline __attribute__((always_inline)) void
+scrypt_lookup_32x4(uint32x4 Y[32], uint32x4 r, int rmax)
+{
+	uint32x4 Z[32], m;
+	int k, step;
+
+	for (k = 0; k < 32; k++)
+		Z[k] = Y[k];
+	for (step = 1; step <= rmax; step++) {
+		salsa20_8_xor_32x4(&Z[0], &Z[16]);
+		salsa20_8_xor_32x4(&Z[16], &Z[0]);
+		m = (uint32x4)(r == (uint32x4){} + step);
+		for (k = 0; k < 32; k++)
+			Y[k] = (Z[k] & m) | (Y[k] & ~m);
+	}
+}
+
+/**
+ * The most performance critical part of scrypt (N = 1024, r = 1, p = 1).
+ * Handles four hashes at a time, one per 32-bit lane of the SSE2
+ * registers ("vertical" layout). The working state X is kept transposed,
+ * while every hash has its own contiguous 128 KiB V region. Only needs
+ * SSE2, so it works on any x86-64 CPU.
+ *
+ * databuf - four 128 bytes buffers for data input and output
+ * scratch - temporary buffer, it must have size at
+ *           least (4 * 128 + 4 * 128 * SCRYPT_V_STRIDE(gap)) bytes
+ * gap     - lookup gap, only every gap-th V entry is stored
+ *
+ * All buffers must be aligned at 64 byte boundary.
+ */
+static inline
+void scrypt_simd_core4(uint32_t databuf[4 * 32], void * scratch, int gap)
+{
+	uint32x4 * X = (uint32x4 *)scratch;
+	uint32_t * V = (uint32_t *)((uintptr_t)scratch + 4 * 128);
+	uint32x4   T[4];
+	uint32_t * Vj[4];
+	uint32x4   Y[32], r;
+	int nV = SCRYPT_V_STRIDE(gap);
+	int i, j, k, l, rmax;
+
+	/* 1: X <-- B */
+	for (k = 0; k < 32; k += 4) {
+		for (l = 0; l < 4; l++)
+			T[l] = *(uint32x4 *)&databuf[l * 32 + k];
+		transpose_32x4(&X[k], T);
+	}
+
+	/* 2: for i = 0 to N - 1 do */
+	for (i = 0; i < 1024; i++) {
+		for (k = 0; k < 32 && i % gap == 0; k += 4) {
+			transpose_32x4(T, &X[k]);
+			for (l = 0; l < 4; l++)
+				*(uint32x4 *)&V[(l * nV + i / gap) * 32 + k] = T[l];
+		}
+		salsa20_8_xor_32x4(&X[0], &X[16]);
+		salsa20_8_xor_32x4(&X[16], &X[0]);
+	}
+
+	/* 6: for i = 0 to N - 1 do */
+	for (i = 0; i < 1024; i++) {
+		rmax = 0;
+		for (l = 0; l < 4; l++) {
+			j = X[16][l] & 1023; /* j <-- Integerify(X) mod N */
+			Vj[l] = &V[(l * nV + j / gap) * 32];
+			r[l] = j % gap;
+			if (r[l] > rmax)
+				rmax = r[l];
+		}
+		for (k = 0; k < 32; k += 4) {
+			uint32x4 S[4];
+			for (l = 0; l < 4; l++)
+				S[l] = *(uint32x4 *)&Vj[l][k];
+			transpose_32x4(&Y[k], S);
+		}
+		if (rmax)
+			scrypt_lookup_32x4(Y, r, rmax);
+		for (k = 0; k < 32; k++)
+			X[k] ^= Y[k];
+		salsa20_8_xor_32x4(&X[0], &X[16]);
+		salsa20_8_xor_32x4(&X[16], &X[0]);
+	}
+
+	/* 10: B' <-- X */
+	for (k = 0; k < 32; k += 4) {
+		transpose_32x4(T, &X[k]);
+		for (l = 0; l < 4; l++)
+			*(uint32x4 *)&databuf[l * 32 + k] = T[l];
+	}
+}
+
+#endif
+
+#ifdef __AVX2__
+
+#include <immintrin.h>
+
+#define HAVE_SCRYPT_SIMD_CORE8
+
+typedef uint32_t uint32x8 __attribute__ ((vector_size(32), aligned(32)));
+
+static inline __attribute__((always_inline)) uint32x8
+rol_32x8(uint32x8 a, uint32_t b)
+{
+	return (uint32x8)_mm256_slli_epi32((__m256i)a, b) ^
+	       (uint32x8)_mm256_srli_epi32((__m256i)a, 32 - b);
+}
+
+/*
+ * Transpose a 8x8 matrix of 32-bit words. Converts between eight words
+ * of a single hash stored in one register and the same word of eight
+ * hashes stored in one register.
+ */
+static inline __attribute__((always_inline)) void
+transpose_32x8(uint32x8 D[8], const uint32x8 S[8])
+{
+	__m256i t0, t1, t2, t3, t4, t5, t6, t7;
+	__m256i u0, u1, u2, u3, u4, u5, u6, u7;
+
+	t0 = _mm256_unpacklo_epi32((__m256i)S[0], (__m256i)S[1]);
+	t1 = _mm256_unpackhi_epi32((__m256i)S[0], (__m256i)S[1]);
+	t2 = _mm256_unpacklo_epi32((__m256i)S[2], (__m256i)S[3]);
+	t3 = _mm256_unpackhi_epi32((__m256i)S[2], (__m256i)S[3]);
+	t4 = _mm256_unpacklo_epi32((__m256i)S[4], (__m256i)S[5]);
+	t5 = _mm256_unpackhi_epi32((__m256i)S[4], (__m256i)S[5]);
+	t6 = _mm256_unpacklo_epi32((__m256i)S[6], (__m256i)S[7]);
+	t7 = _mm256_unpackhi_epi32((__m256i)S[6], (__m256i)S[7]);
+
+	u0 = _mm256_unpacklo_epi64(t0, t2);
+	u1 = _mm256_unpackhi_epi64(t0, t2);
+	u2 = _mm256_unpacklo_epi64(t1, t3);
+	u3 = _mm256_unpackhi_epi64(t1, t3);
+	u4 = _mm256_unpacklo_epi64(t4, t6);
+	u5 = _mm256_unpackhi_epi64(t4, t6);
+	u6 = _mm256_unpacklo_epi64(t5, t7);
+	u7 = _mm256_unpackhi_epi64(t5, t7);
+
+	D[0] = (uint32x8)_mm256_permute2x128_si256(u0, u4, 0x20);
+	D[1] = (uint32x8)_mm256_permute2x128_si256(u1, u5, 0x20);
+	D[2] = (uint32x8)_mm256_permute2x128_si256(u2, u6, 0x20);
+	D[3] = (uint32x8)_mm256_permute2x128_si256(u3, u7, 0x20);
+	D[4] = (uint32x8)_mm256_permute2x128_si256(u0, u4, 0x31);
+	D[5] = (uint32x8)_mm256_permute2x128_si256(u1, u5, 0x31);
+	D[6] = (uint32x8)_mm256_permute2x128_si256(u2, u6, 0x31);
+	D[7] = (uint32x8)_mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+/**
+ * salsa20_8(B):
+ * Apply the salsa20/8 core to eight blocks at once. Each register holds
+ * the same word of eight independent blocks, so the columns and rows can
+ * be processed without any data rearrangement.
+ */
+static inline __attribute__((always_inline)) void
+salsa20_8_xor_32x8(uint32x8 * __restrict B, const uint32x8 * __restrict Bx)
+{
+	uint32x8 x00,x01,x02,x03,x04,x05,x06,x07,x08,x09,x10,x11,x12,x13,x14,x15;
+	int i;
+
+	x00 = (B[ 0] ^= Bx[ 0]);
+	x01 = (B[ 1] ^= Bx[ 1]);
+	x02 = (B[ 2] ^= Bx[ 2]);
+	x03 = (B[ 3] ^= Bx[ 3]);
+	x04 = (B[ 4] ^= Bx[ 4]);
+	x05 = (B[ 5] ^= Bx[ 5]);
+	x06 = (B[ 6] ^= Bx[ 6]);
+	x07 = (B[ 7] ^= Bx[ 7]);
+	x08 = (B[ 8] ^= Bx[ 8]);
+	x09 = (B[ 9] ^= Bx[ 9]);
+	x10 = (B[10] ^= Bx[10]);
+	x11 = (B[11] ^= Bx[11]);
+	x12 = (B[12] ^= Bx[12]);
+	x13 = (B[13] ^= Bx[13]);
+	x14 = (B[14] ^= Bx[14]);
+	x15 = (B[15] ^= Bx[15]);
+	for (i = 0; i < 8; i += 2) {
+#define R(a,b) rol_32x8(a, b)
+		/* Operate on columns. */
+		x04 ^= R(x00+x12, 7);	x09 ^= R(x05+x01, 7);	x14 ^= R(x10+x06, 7);	x03 ^= R(x15+x11, 7);
+		x08 ^= R(x04+x00, 9);	x13 ^= R(x09+x05, 9);	x02 ^= R(x14+x10, 9);	x07 ^= R(x03+x15, 9);
+		x12 ^= R(x08+x04,13);	x01 ^= R(x13+x09,13);	x06 ^= R(x02+x14,13);	x11 ^= R(x07+x03,13);
+		x00 ^= R(x12+x08,18);	x05 ^= R(x01+x13,18);	x10 ^= R(x06+x02,18);	x15 ^= R(x11+x07,18);
+
+		/* Operate on rows. */
+		x01 ^= R(x00+x03, 7);	x06 ^= R(x05+x04, 7);	x11 ^= R(x10+x09, 7);	x12 ^= R(x15+x14, 7);
+		x02 ^= R(x01+x00, 9);	x07 ^= R(x06+x05, 9);	x08 ^= R(x11+x10, 9);	x13 ^= R(x12+x15, 9);
+		x03 ^= R(x02+x01,13);	x04 ^= R(x07+x06,13);	x09 ^= R(x08+x11,13);	x14 ^= R(x13+x12,13);
+		x00 ^= R(x03+x02,18);	x05 ^= R(x04+x07,18);	x10 ^= R(x09+x08,18);	x15 ^= R(x14+x13,18);
+#undef R
+	}
+	B[ 0] += x00;
+	B[ 1] += x01;
+	B[ 2] += x02;
+	B[ 3] += x03;
+	B[ 4] += x04;
+	B[ 5] += x05;
+	B[ 6] += x06;
+	B[ 7] += x07;
+	B[ 8] += x08;
+	B[ 9] += x09;
+	B[10] += x10;
+	B[11] += x11;
+	B[12] += x12;
+	B[13] += x13;
+	B[14] += x14;
+	B[15] += x15;
+}
+
+/*
+ * Recompute the V entries which are not stored because of the lookup gap.
+ * Y holds the closest stored entries, and lane l needs r[l] more steps.
+ * All the lanes are advanced together and each one keeps the block from
+ * its own step.
+ */
+static inline __attribute__((always_inline)) void
+scrypt_lookup_32x8(uint32x8 Y[32], uint32x8 r, int rmax)
+{
+	uint32x8 Z[32], m;
+	int k, step;
+
+	for (k = 0; k < 32; k++)
+		Z[k] = Y[k];
+	for (step = 1; step <= rmax; step++) {
+		salsa20_8_xor_32x8(&Z[0], &Z[16]);
+		salsa20_8_xor_32x8(&Z[16], &Z[0]);
+		m = (uint32x8)(r == (uint32x8){} + step);
+		for (k = 0; k < 32; k++)
+			Y[k] = (Z[k] & m) | (Y[k] & ~m);
+	}
+}
+
+/**
+ * The most performance critical part of scrypt (N = 1024, r = 1, p = 1).
+ * Handles eight hashes at a time, one per 32-bit lane of the AVX2
+ * registers. The working state X is kept transposed (word k of all the
+ * eight hashes in X[k]), while every hash has its own contiguous
+ * 128 KiB V region. The blocks are transposed when they are stored
+ * to V and when they are fetched back, so that each lookup in the
+ * second loop only touches the two cache lines of the selected block.
+ *
+ * databuf - eight 128 bytes buffers for data input and output
+ * scratch - temporary buffer, it must have size at
+ *           least (8 * 128 + 8 * 128 * SCRYPT_V_STRIDE(gap)) bytes
+ * gap     - lookup gap, only every gap-th V entry is stored
+ *
+ * All buffers must be aligned at 64 byte boundary.
+ */
+static inline
+void scrypt_simd_core8(uint32_t databuf[8 * 32], void * scratch, int gap)
+{
+	uint32x8 * X = (uint32x8 *)scratch;
+	uint32_t * V = (uint32_t *)((uintptr_t)scratch + 8 * 128);
+	uint32x8   T[8];
+	uint32_t * Vj[8];
+	uint32x8   Y[32], r;
+	int nV = SCRYPT_V_STRIDE(gap);
+	int i, j, k, l, rmax;
+
+	/* 1: X <-- B */
+	for (k = 0; k < 32; k += 8) {
+		for (l = 0; l < 8; l++)
+			T[l] = *(uint32x8 *)&databuf[l * 32 + k];
+		transpose_32x8(&X[k], T);
+	}
+
+	/* 2: for i = 0 to N - 1 do */
+	for (i = 0; i < 1024; i++) {
+		for (k = 0; k < 32 && i % gap == 0; k += 8) {
+			transpose_32x8(T, &X[k]);
+			for (l = 0; l < 8; l++)
+				*(uint32x8 *)&V[(l * nV + i / gap) * 32 + k] = T[l];
+		}
+		salsa20_8_xor_32x8(&X[0], &X[16]);
+		salsa20_8_xor_32x8(&X[16], &X[0]);
+	}
+
+	/* 6: for i = 0 to N - 1 do */
+	for (i = 0; i < 1024; i++) {
+		rmax = 0;
+		for (l = 0; l < 8; l++) {
+			j = X[16][l] & 1023; /* j <-- Integerify(X) mod N */
+			Vj[l] = &V[(l * nV + j / gap) * 32];
+			r[l] = j % gap;
+			if (r[l] > rmax)
+				rmax = r[l];
+		}
+		for (k = 0; k < 32; k += 8) {
+			uint32x8 S[8];
+			for (l = 0; l < 8; l++)
+				S[l] = *(uint32x8 *)&Vj[l][k];
+			transpose_32x8(&Y[k], S);
+		}
+		if (rmax)
+			scrypt_lookup_32x8(Y, r, rmax);
+		for (k = 0; k < 32; k++)
+			X[k] ^= Y[k];
+		salsa20_8_xor_32x8(&X[0], &X[16]);
+		salsa20_8_xor_32x8(&X[16], &X[0]);
+	}
+
+	/* 10: B' <-- X */
+	for (k = 0; k < 32; k += 8) {
+		transpose_32x8(T, &X[k]);
+		for (l = 0; l < 8; l++)
+			*(uint32x8 *)&databuf[l * 32 + k] = T[l];
+	}
+}
+
+/*
+ * The pipelined kernels split their lanes into this many groups. The V
+ * lookups of one group are prefetched as soon as their addresses are
+ * known, and the other groups are mixed while they are in flight. So
+ * this is also the prefetch distance, measured in group steps.
+ */
+#ifndef SCRYPT_PREFETCH_GROUPS
+#define SCRYPT_PREFETCH_GROUPS 2
+#endif
+
+/* Find the V entries needed by the next step of eight hashes */
+static inline __attribute__((always_inline)) int
+scrypt_prefetch_32x8(uint32_t * Vj[8], uint32x8 * r, const uint32x8 X[32],
+                     uint32_t * V, int nV, int gap)
+{
+	int j, l, rmax = 0;
+
+	for (l = 0; l < 8; l++) {
+		j = X[16][l] & 1023; /* j <-- Integerify(X) mod N */
+		Vj[l] = &V[(l * nV + j / gap) * 32];
+		(*r)[l] = j % gap;
+		if ((*r)[l] > rmax)
+			rmax = (*r)[l];
+		__builtin_prefetch(&Vj[l][0]);
+		__builtin_prefetch(&Vj[l][16]);
+	}
+	return rmax;
+}
+
+/**
+ * Same as 'scrypt_simd_core8', but handles SCRYPT_PREFETCH_GROUPS groups
+ * of eight hashes in a software pipeline, similar to the DMA double
+ * buffering done by 'scrypt_spu_core8' on Cell. While one group is mixed,
+ * the V entries for the others are being prefetched, so the random reads
+ * of the second loop do not stall the core.
+ *
+ * databuf - (SCRYPT_PREFETCH_GROUPS * 8) 128 bytes buffers for data input
+ *           and output
+ * scratch - temporary buffer, it must have size at least
+ *           (SCRYPT_PREFETCH_GROUPS * 8 * (128 + 128 * SCRYPT_V_STRIDE(gap)))
+ *           bytes
+ * gap     - lookup gap, only every gap-th V entry is stored
+ *
+ * All buffers must be aligned at 64 byte boundary.
+ */
+static inline
+void scrypt_simd_core8_pipelined(
+	uint32_t databuf[SCRYPT_PREFETCH_GROUPS * 8 * 32],
+	void * scratch, int gap)
+{
+	uint32x8 (* X)[32] = (uint32x8 (*)[32])scratch;
+	uint32_t * V = (uint32_t *)((uintptr_t)scratch +
+	                            SCRYPT_PREFETCH_GROUPS * 8 * 128);
+	uint32x8   T[8];
+	uint32_t * Vj[SCRYPT_PREFETCH_GROUPS][8];
+	uint32x8   Y[32], r[SCRYPT_PREFETCH_GROUPS];
+	int        rmax[SCRYPT_PREFETCH_GROUPS];
+	int nV = SCRYPT_V_STRIDE(gap);
+	int g, i, k, l;
+
+	/* 1: X <-- B */
+	for (g = 0; g < SCRYPT_PREFETCH_GROUPS; g++) {
+		for (k = 0; k < 32; k += 8) {
+			for (l = 0; l < 8; l++)
+				T[l] = *(uint32x8 *)&databuf[(g * 8 + l) * 32 + k];
+			transpose_32x8(&X[g][k], T);
+		}
+	}
+
+	/* 2: for i = 0 to N - 1 do */
+	for (i = 0; i < 1024; i++) {
+		for (g = 0; g < SCRYPT_PREFETCH_GROUPS; g++) {
+			uint32_t * Vg = &V[g * 8 * nV * 32];
+			for (k = 0; k < 32 && i % gap == 0; k += 8) {
+				transpose_32x8(T, &X[g][k]);
+				for (l = 0; l < 8; l++)
+					*(uint32x8 *)&Vg[(l * nV + i / gap) * 32 + k] = T[l];
+			}
+			salsa20_8_xor_32x8(&X[g][0], &X[g][16]);
+			salsa20_8_xor_32x8(&X[g][16], &X[g][0]);
+		}
+	}
+
+	/* fill the pipeline */
+	for (g = 0; g < SCRYPT_PREFETCH_GROUPS; g++)
+		rmax[g] = scrypt_prefetch_32x8(Vj[g], &r[g], X[g],
+		                               &V[g * 8 * nV * 32], nV, gap);
+
+	/* 6: for i = 0 to N - 1 do */
+	for (i = 0; i < 1024; i++) {
+		for (g = 0; g < SCRYPT_PREFETCH_GROUPS; g++) {
+			for (k = 0; k < 32; k += 8) {
+				uint32x8 S[8];
+				for (l = 0; l < 8; l++)
+					S[l] = *(uint32x8 *)&Vj[g][l][k];
+				transpose_32x8(&Y[k], S);
+			}
+			if (rmax[g])
+				scrypt_lookup_32x8(Y, r[g], rmax[g]);
+			for (k = 0; k < 32; k++)
+				X[g][k] ^= Y[k];
+			salsa20_8_xor_32x8(&X[g][0], &X[g][16]);
+			salsa20_8_xor_32x8(&X[g][16], &X[g][0]);
+			rmax[g] = scrypt_prefetch_32x8(Vj[g], &r[g], X[g],
+			                               &V[g * 8 * nV * 32], nV, gap);
+		}
+	}
+
+	/* 10: B' <-- X */
+	for (g = 0; g < SCRYPT_PREFETCH_GROUPS; g++) {
+		for (k = 0; k < 32; k += 8) {
+			transpose_32x8(T, &X[g][k]);
+			for (l = 0; l < 8; l++)
+				*(uint32x8 *)&databuf[(g * 8 + l) * 32 + k] = T[l];
+		}
+	}
+}
+
+
+static inline __attribute__((always_inline)) uint32x8
+shr_32x8(uint32x8 a, uint32_t b)
+{
+	return (uint32x8)_mm256_srli_epi32((__m256i)a, b);
+}
+
+/* Eight-way version of the multi-buffer SHA256 above */
+
+#define S0_32x8(x)	(rol_32x8(x, 30) ^ rol_32x8(x, 19) ^ rol_32x8(x, 10))
+#define S1_32x8(x)	(rol_32x8(x, 26) ^ rol_32x8(x, 21) ^ rol_32x8(x, 7))
+#define s0_32x8(x)	(rol_32x8(x, 25) ^ rol_32x8(x, 14) ^ shr_32x8(x, 3))
+#define s1_32x8(x)	(rol_32x8(x, 15) ^ rol_32x8(x, 13) ^ shr_32x8(x, 10))
+
+#define splat_32x8(x)	((uint32x8){ (x), (x), (x), (x), (x), (x), (x), (x) })
+
+/* Round 'i + j' with the state rotated by 'j' */
+#define RNDr_32x8(S, W, i, j)						\
+	do {								\
+		uint32x8 t0, t1;					\
+		t0 = S[(15 - j) % 8] + S1_32x8(S[(12 - j) % 8]) +	\
+		     Ch(S[(12 - j) % 8], S[(13 - j) % 8],		\
+		        S[(14 - j) % 8]) +				\
+		     W[i + j] + splat_32x8(sha256_k[i + j]);		\
+		t1 = S0_32x8(S[(8 - j) % 8]) +				\
+		     Maj(S[(8 - j) % 8], S[(9 - j) % 8], S[(10 - j) % 8]); \
+		S[(11 - j) % 8] += t0;					\
+		S[(15 - j) % 8] = t0 + t1;				\
+	} while (0)
+
+static inline void
+SHA256_Transform_8way(uint32x8 state[8], const uint32x8 block[16])
+{
+	uint32x8 W[64], S[8];
+	int i;
+
+	for (i = 0; i < 16; i++)
+		W[i] = block[i];
+	for (; i < 64; i++)
+		W[i] = s1_32x8(W[i - 2]) + W[i - 7] +
+		       s0_32x8(W[i - 15]) + W[i - 16];
+
+	for (i = 0; i < 8; i++)
+		S[i] = state[i];
+	for (i = 0; i < 64; i += 8) {
+		RNDr_32x8(S, W, i, 0);
+		RNDr_32x8(S, W, i, 1);
+		RNDr_32x8(S, W, i, 2);
+		RNDr_32x8(S, W, i, 3);
+		RNDr_32x8(S, W, i, 4);
+		RNDr_32x8(S, W, i, 5);
+		RNDr_32x8(S, W, i, 6);
+		RNDr_32x8(S, W, i, 7);
+	}
+	for (i = 0; i < 8; i++)
+		state[i] += S[i];
+}
+
+/* Gather word 'i' of eight byteswapped input buffers */
+static inline __attribute__((always_inline)) uint32x8
+load_be_8way(const uint32_t * const p[8], int i)
+{
+	uint32x8 r = {
+		byteswap(p[0][i]), byteswap(p[1][i]),
+		byteswap(p[2][i]), byteswap(p[3][i]),
+		byteswap(p[4][i]), byteswap(p[5][i]),
+		byteswap(p[6][i]), byteswap(p[7][i])
+	};
+	return r;
+}
+
+static inline __attribute__((always_inline)) void
+store_be_8way(uint32_t * const p[8], int i, uint32x8 v)
+{
+	p[0][i] = byteswap(v[0]);
+	p[1][i] = byteswap(v[1]);
+	p[2][i] = byteswap(v[2]);
+	p[3][i] = byteswap(v[3]);
+	p[4][i] = byteswap(v[4]);
+	p[5][i] = byteswap(v[5]);
+	p[6][i] = byteswap(v[6]);
+	p[7][i] = byteswap(v[7]);
+}
+
+/* Eight-way versions of 'SHA256_Schedule' and 'SHA256_Rounds' */
+static inline void
+SHA256_Schedule_8way(uint32x8 W[64], int first)
+{
+	int i;
+
+	for (i = first; i < 64; i++)
+		W[i] = s1_32x8(W[i - 2]) + W[i - 7] +
+		       s0_32x8(W[i - 15]) + W[i - 16];
+}
+
+static inline void
+SHA256_Rounds_8way(uint32x8 S[8], const uint32x8 W[64], int first, int last)
+{
+	uint32x8 a = S[0], b = S[1], c = S[2], d = S[3];
+	uint32x8 e = S[4], f = S[5], g = S[6], h = S[7];
+	uint32x8 t0, t1;
+	int i;
+
+#if !defined(__clang__) && (__GNUC__ >= 8)
+#pragma GCC unroll 64
+#endif
+	for (i = first; i < last; i++) {
+		t0 = h + S1_32x8(e) + Ch(e, f, g) + W[i] +
+		     splat_32x8(sha256_k[i]);
+		t1 = S0_32x8(a) + Maj(a, b, c);
+		h = g; g = f; f = e; e = d + t0;
+		d = c; c = b; b = a; a = t0 + t1;
+	}
+
+	S[0] = a; S[1] = b; S[2] = c; S[3] = d;
+	S[4] = e; S[5] = f; S[6] = g; S[7] = h;
+}
+
+/* Eight-way version of 'SHA256_Transform_word7' */
+static inline uint32x8
+SHA256_Transform_word7_8way(const uint32x8 state[8], const uint32x8 block[16])
+{
+	uint32x8 W[64], S[8];
+	int i;
+
+	for (i = 0; i < 16; i++)
+		W[i] = block[i];
+	for (; i < 61; i++)
+		W[i] = s1_32x8(W[i - 2]) + W[i - 7] +
+		       s0_32x8(W[i - 15]) + W[i - 16];
+	for (i = 0; i < 8; i++)
+		S[i] = state[i];
+	SHA256_Rounds_8way(S, W, 0, 61);
+	return state[7] + S[4];
+}
+
+/**
+ * Same as 'PBKDF2_SHA256_80_128_init' for eight passwords at once, which
+ * only differ in the nonce, so they share the precomputed parts in 'ctx'.
+ */
+static inline void
+PBKDF2_SHA256_80_128_init_8way(const PBKDF2_SHA256_80_CTX *ctx,
+                               const uint32_t * const passwd[8],
+                               uint32x8 tstate[8], uint32x8 ostate[8])
+{
+	uint32_t init[8];
+	uint32x8 W[64], S[8];
+	uint32x8 ihash[8];
+	uint32x8 pad[16];
+	int i;
+
+	for (i = 0; i < 18; i++)
+		W[i] = splat_32x8(ctx->tailW[i]);
+	W[3] = load_be_8way(passwd, 19);
+	SHA256_Schedule_8way(W, 18);
+	for (i = 0; i < 8; i++)
+		S[i] = splat_32x8(ctx->tailS[i]);
+	SHA256_Rounds_8way(S, W, 3, 64);
+	for (i = 0; i < 8; i++)
+		ihash[i] = splat_32x8(ctx->midstate[i]) + S[i];
+
+	SHA256_InitState(init);
+	for (i = 0; i < 8; i++)
+		ostate[i] = splat_32x8(init[i]);
+	for (i = 0; i < 8; i++)
+		pad[i] = ihash[i] ^ splat_32x8(0x5c5c5c5c);
+	for (; i < 16; i++)
+		pad[i] = splat_32x8(0x5c5c5c5c);
+	SHA256_Transform_8way(ostate, pad);
+
+	for (i = 0; i < 8; i++)
+		tstate[i] = splat_32x8(init[i]);
+	for (i = 0; i < 8; i++)
+		pad[i] = ihash[i] ^ splat_32x8(0x36363636);
+	for (; i < 16; i++)
+		pad[i] = splat_32x8(0x36363636);
+	SHA256_Transform_8way(tstate, pad);
+}
+
+/**
+ * Same as 'PBKDF2_SHA256_80_128' for eight passwords at once, the output
+ * of every lane goes to its own 128 bytes buffer.
+ */
+static inline void
+PBKDF2_SHA256_80_128_8way(const PBKDF2_SHA256_80_CTX *ctx,
+                          const uint32x8 tstate[8], const uint32x8 ostate[8],
+                          const uint32_t * const passwd[8],
+                          uint32_t * const buf[8])
+{
+	uint32x8 W[64], S[8], S4[8];
+	uint32x8 ihash[8], obuf[16];
+	int i, k;
+
+	for (i = 0; i < 64; i++)
+		W[i] = splat_32x8(ctx->headW[i]);
+	for (i = 0; i < 8; i++)
+		S[i] = tstate[i];
+	SHA256_Rounds_8way(S, W, 0, 64);
+	for (i = 0; i < 8; i++)
+		ihash[i] = tstate[i] + S[i];
+
+	/* the rounds 0 - 3 are the same for all the blocks */
+	for (i = 0; i < 18; i++)
+		W[i] = splat_32x8(ctx->innerW[i]);
+	W[3] = load_be_8way(passwd, 19);
+	W[18] = s1_32x8(W[16]) + W[11] + s0_32x8(W[3]) + W[2];
+	for (i = 0; i < 8; i++)
+		S4[i] = ihash[i];
+	SHA256_Rounds_8way(S4, W, 0, 4);
+
+	for (i = 0; i < 8; i++)
+		obuf[8 + i] = splat_32x8(outerpad[i]);
+
+	/* Iterate through the blocks. */
+	for (i = 0; i < 4; i++) {
+		uint32x8 ost[8];
+
+		W[4] = splat_32x8(i + 1);
+		SHA256_Schedule_8way(W, 19);
+		for (k = 0; k < 8; k++)
+			S[k] = S4[k];
+		SHA256_Rounds_8way(S, W, 4, 64);
+		for (k = 0; k < 8; k++)
+			obuf[k] = ihash[k] + S[k];
+
+		for (k = 0; k < 8; k++)
+			ost[k] = ostate[k];
+		SHA256_Transform_8way(ost, obuf);
+		for (k = 0; k < 8; k++)
+			store_be_8way(buf, i * 8 + k, ost[k]);
+	}
+}
+
+/**
+ * Same as 'PBKDF2_SHA256_80_128_32' for eight salts at once. The whole output
+ * is only computed when word 7 of some lane is not above 'Htarg'.
+ */
+static inline void
+PBKDF2_SHA256_80_128_32_8way(const PBKDF2_SHA256_80_CTX *ctx,
+                             uint32x8 tstate[8], uint32x8 ostate[8],
+                             const uint32_t * const salt[8],
+                             uint32_t * const output[8], uint32_t Htarg)
+{
+	uint32x8 W[64], S[8];
+	uint32x8 pad[16];
+	int i;
+
+	for (i = 0; i < 16; i++)
+		pad[i] = load_be_8way(salt, i);
+	SHA256_Transform_8way(tstate, pad);
+	for (i = 0; i < 16; i++)
+		pad[i] = load_be_8way(salt, 16 + i);
+	SHA256_Transform_8way(tstate, pad);
+	for (i = 0; i < 64; i++)
+		W[i] = splat_32x8(ctx->finalW[i]);
+	for (i = 0; i < 8; i++)
+		S[i] = tstate[i];
+	SHA256_Rounds_8way(S, W, 0, 64);
+
+	for (i = 0; i < 8; i++)
+		pad[i] = tstate[i] + S[i];
+	for (; i < 16; i++)
+		pad[i] = splat_32x8(outerpad[i - 8]);
+
+	store_be_8way(output, 7, SHA256_Transform_word7_8way(ostate, pad));
+	for (i = 0; i < 8 && output[i][7] > Htarg; i++)
+		;
+	if (i == 8)
+		return;
+
+	SHA256_Transform_8way(ostate, pad);
+	for (i = 0; i < 8; i++)
+		store_be_8way(output, i, ostate[i]);
+}
+
+#endif
+
+#ifdef __AVX512F__
+
+#define HAVE_SCRYPT_SIMD_CORE16
+
+typedef uint32_t uint32x16 __attribute__ ((vector_size(64), aligned(64)));
+
+/* AVX-512 has a native rotate (VPROLD), which needs an immediate operand */
+#define rol_32x16(a, b) (uint32x16)_mm512_rol_epi32((__m512i)(a), (b))
+
+/*
+ * Transpose a 16x16 matrix of 32-bit words. Converts between sixteen words
+ * of a single hash stored in one register and the same word of sixteen
+ * hashes stored in one register.
+ */
+static inline __attribute__((always_inline)) void
+transpose_32x16(uint32x16 D[16], const uint32x16 S[16])
+{
+	__m512i t[16], u[16], v[16];
+	int i;
+
+	for (i = 0; i < 16; i += 2) {
+		t[i]     = _mm512_unpacklo_epi32((__m512i)S[i], (__m512i)S[i + 1]);
+		t[i + 1] = _mm512_unpackhi_epi32((__m512i)S[i], (__m512i)S[i + 1]);
+	}
+	for (i = 0; i < 16; i += 4) {
+		u[i]     = _mm512_unpacklo_epi64(t[i], t[i + 2]);
+		u[i + 1] = _mm512_unpackhi_epi64(t[i], t[i + 2]);
+		u[i + 2] = _mm512_unpacklo_epi64(t[i + 1], t[i + 3]);
+		u[i + 3] = _mm512_unpackhi_epi64(t[i + 1], t[i + 3]);
+	}
+	for (i = 0; i < 4; i++) {
+		v[i]      = _mm512_shuffle_i32x4(u[i], u[i + 4], 0x88);
+		v[i + 4]  = _mm512_shuffle_i32x4(u[i], u[i + 4], 0xdd);
+		v[i + 8]  = _mm512_shuffle_i32x4(u[i + 8], u[i + 12], 0x88);
+		v[i + 12] = _mm512_shuffle_i32x4(u[i + 8], u[i + 12], 0xdd);
+	}
+	for (i = 0; i < 4; i++) {
+		D[i]      = (uint32x16)_mm512_shuffle_i32x4(v[i], v[i + 8], 0x88);
+		D[i + 4]  = (uint32x16)_mm512_shuffle_i32x4(v[i + 4], v[i + 12], 0x88);
+		D[i + 8]  = (uint32x16)_mm512_shuffle_i32x4(v[i], v[i + 8], 0xdd);
+		D[i + 12] = (uint32x16)_mm512_shuffle_i32x4(v[i + 4], v[i + 12], 0xdd);
+	}
+}
+
+/**
+ * salsa20_8(B):
+ * Apply the salsa20/8 core to sixteen blocks at once, one block per
+ * 32-bit lane of the AVX-512 registers.
+ */
+static inline __attribute__((always_inline)) void
+salsa20_8_xor_32x16(uint32x16 * __restrict B, const uint32x16 * __restrict Bx)
+{
+	uint32x16 x00,x01,x02,x03,x04,x05,x06,x07,x08,x09,x10,x11,x12,x13,x14,x15;
+	int i;
+
+	x00 = (B[ 0] ^= Bx[ 0]);
+	x01 = (B[ 1] ^= Bx[ 1]);
+	x02 = (B[ 2] ^= Bx[ 2]);
+	x03 = (B[ 3] ^= Bx[ 3]);
+	x04 = (B[ 4] ^= Bx[ 4]);
+	x05 = (B[ 5] ^= Bx[ 5]);
+	x06 = (B[ 6] ^= Bx[ 6]);
+	x07 = (B[ 7] ^= Bx[ 7]);
+	x08 = (B[ 8] ^= Bx[ 8]);
+	x09 = (B[ 9] ^= Bx[ 9]);
+	x10 = (B[10] ^= Bx[10]);
+	x11 = (B[11] ^= Bx[11]);
+	x12 = (B[12] ^= Bx[12]);
+	x13 = (B[13] ^= Bx[13]);
+	x14 = (B[14] ^= Bx[14]);
+	x15 = (B[15] ^= Bx[15]);
+	for (i = 0; i < 8; i += 2) {
+#define R(a,b) rol_32x16(a, b)
+		/* Operate on columns. */
+		x04 ^= R(x00+x12, 7);	x09 ^= R(x05+x01, 7);	x14 ^= R(x10+x06, 7);	x03 ^= R(x15+x11, 7);
+		x08 ^= R(x04+x00, 9);	x13 ^= R(x09+x05, 9);	x02 ^= R(x14+x10, 9);	x07 ^= R(x03+x15, 9);
+		x12 ^= R(x08+x04,13);	x01 ^= R(x13+x09,13);	x06 ^= R(x02+x14,13);	x11 ^= R(x07+x03,13);
+		x00 ^= R(x12+x08,18);	x05 ^= R(x01+x13,18);	x10 ^= R(x06+x02,18);	x15 ^= R(x11+x07,18);
+
+		/* Operate on rows. */
+		x01 ^= R(x00+x03, 7);	x06 ^= R(x05+x04, 7);	x11 ^= R(x10+x09, 7);	x12 ^= R(x15+x14, 7);
+		x02 ^= R(x01+x00, 9);	x07 ^= R(x06+x05, 9);	x08 ^= R(x11+x10, 9);	x13 ^= R(x12+x15, 9);
+		x03 ^= R(x02+x01,13);	x04 ^= R(x07+x06,13);	x09 ^= R(x08+x11,13);	x14 ^= R(x13+x12,13);
+		x00 ^= R(x03+x02,18);	x05 ^= R(x04+x07,18);	x10 ^= R(x09+x08,18);	x15 ^= R(x14+x13,18);
+#undef R
+	}
+	B[ 0] += x00;
+	B[ 1] += x01;
+	B[ 2] += x02;
+	B[ 3] += x03;
+	B[ 4] += x04;
+	B[ 5] += x05;
+	B[ 6] += x06;
+	B[ 7] += x07;
+	B[ 8] += x08;
+	B[ 9] += x09;
+	B[10] += x10;
+	B[11] += x11;
+	B[12] += x12;
+	B[13] += x13;
+	B[14] += x14;
+	B[15] += x15;
+}
+
+/*
+ * Recompute the V entries which are not stored because of the lookup gap.
+ * Y holds the closest stored entries, and lane l needs r[l] more steps.
+ * All the lanes are advanced together and each one keeps the block from
+ * its own step.
+ */
+static inline __attribute__((always_inline)) void
+scrypt_lookup_32x16(uint32x16 Y[32], uint32x16 r, int rmax)
+{
+	uint32x16 Z[32], m;
+	int k, step;
+
+	for (k = 0; k < 32; k++)
+		Z[k] = Y[k];
+	for (step = 1; step <= rmax; step++) {
+		salsa20_8_xor_32x16(&Z[0], &Z[16]);
+		salsa20_8_xor_32x16(&Z[16], &Z[0]);
+		m = (uint32x16)(r == (uint32x16){} + step);
+		for (k = 0; k < 32; k++)
+			Y[k] = (Z[k] & m) | (Y[k] & ~m);
+	}
+}
+
+/**
+ * The most performance critical part of scrypt (N = 1024, r = 1, p = 1).
+ * Handles sixteen hashes at a time, one per 32-bit lane of the AVX-512
+ * registers. Uses the same layout as 'scrypt_simd_core8': X is kept
+ * transposed and every hash has its own contiguous 128 KiB V region.
+ *
+ * databuf - sixteen 128 bytes buffers for data input and output
+ * scratch - temporary buffer, it must have size at
+ *           least (16 * 128 + 16 * 128 * SCRYPT_V_STRIDE(gap)) bytes
+ * gap     - lookup gap, only every gap-th V entry is stored
+ *
+ * All buffers must be aligned at 64 byte boundary.
+ */
+static inline
+void scrypt_simd_core16(uint32_t databuf[16 * 32], void * scratch, int gap)
+{
+	uint32x16 * X = (uint32x16 *)scratch;
+	uint32_t  * V = (uint32_t *)((uintptr_t)scratch + 16 * 128);
+	uint32x16   T[16];
+	uint32_t  * Vj[16];
+	uint32x16  Y[32], r;
+	int nV = SCRYPT_V_STRIDE(gap);
+	int i, j, k, l, rmax;
+
+	/* 1: X <-- B */
+	for (k = 0; k < 32; k += 16) {
+		for (l = 0; l < 16; l++)
+			T[l] = *(uint32x16 *)&databuf[l * 32 + k];
+		transpose_32x16(&X[k], T);
+	}
+
+	/* 2: for i = 0 to N - 1 do */
+	for (i = 0; i < 1024; i++) {
+		for (k = 0; k < 32 && i % gap == 0; k += 16) {
+			transpose_32x16(T, &X[k]);
+			for (l = 0; l < 16; l++)
+				*(uint32x16 *)&V[(l * nV + i / gap) * 32 + k] = T[l];
+		}
+		salsa20_8_xor_32x16(&X[0], &X[16]);
+		salsa20_8_xor_32x16(&X[16], &X[0]);
+	}
+
+	/* 6: for i = 0 to N - 1 do */
+	for (i = 0; i < 1024; i++) {
+		rmax = 0;
+		for (l = 0; l < 16; l++) {
+			j = X[16][l] & 1023; /* j <-- Integerify(X) mod N */
+			Vj[l] = &V[(l * nV + j / gap) * 32];
+			r[l] = j % gap;
+			if (r[l] > rmax)
+				rmax = r[l];
+		}
+		for (k = 0; k < 32; k += 16) {
+			uint32x16 S[16];
+			for (l = 0; l < 16; l++)
+				S[l] = *(uint32x16 *)&Vj[l][k];
+			transpose_32x16(&Y[k], S);
+		}
+		if (rmax)
+			scrypt_lookup_32x16(Y, r, rmax);
+		for (k = 0; k < 32; k++)
+			X[k] ^= Y[k];
+		salsa20_8_xor_32x16(&X[0], &X[16]);
+		salsa20_8_xor_32x16(&X[16], &X[0]);
+	}
+
+	/* 10: B' <-- X */
+	for (k = 0; k < 32; k += 16) {
+		transpose_32x16(T, &X[k]);
+		for (l = 0; l < 16; l++)
+			*(uint32x16 *)&databuf[l * 32 + k] = T[l];
+	}
+}
+
+#endif
+
 #endif
 #endif
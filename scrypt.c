@@ -37,6 +37,9 @@
 #include "sha256-helpers.h"
 #include "scrypt-simd-helpers.h"
 
+/* the most hashes any kernel processes at once */
+#define SCRYPT_MAX_LANES 32
+
 /**
  * salsa20_8(B):
  * Apply the salsa20/8 core to the provided block.
@@ -96,35 +99,55 @@ salsa20_8(uint32_t B[16], const uint32_t Bx[16])
 	B[15] += x15;
 }
 
-static inline void scrypt_core1(uint32_t *X, uint32_t *V)
+/*
+ * Get V[j], recomputing it in Y from the closest stored entry before it
+ * when the lookup gap has left it out
+ */
+static inline uint32_t *scrypt_lookup1(uint32_t *Y, uint32_t *V,
+                                       uint32_t j, int gap)
+{
+	uint32_t k = j % gap;
+
+	if (!k)
+		return &V[(j / gap) * 32];
+
+	memcpy(Y, &V[(j / gap) * 32], 128);
+	while (k--) {
+		salsa20_8(&Y[0], &Y[16]);
+		salsa20_8(&Y[16], &Y[0]);
+	}
+	return Y;
+}
+
+static inline void scrypt_core1(uint32_t *X, uint32_t *V, int gap)
 {
+	uint32_t Y[32];
 	uint32_t i;
-	uint32_t j;
 	uint32_t k;
 	uint32_t *p1, *p2;
 	p1 = X;
 	for (i = 0; i < 1024; i += 2) {
-		memcpy(&V[i * 32], X, 128);
+		if (i % gap == 0)
+			memcpy(&V[(i / gap) * 32], X, 128);
 
 		salsa20_8(&X[0], &X[16]);
 		salsa20_8(&X[16], &X[0]);
 
-		memcpy(&V[(i + 1) * 32], X, 128);
+		if ((i + 1) % gap == 0)
+			memcpy(&V[((i + 1) / gap) * 32], X, 128);
 
 		salsa20_8(&X[0], &X[16]);
 		salsa20_8(&X[16], &X[0]);
 	}
 	for (i = 0; i < 1024; i += 2) {
-		j = X[16] & 1023;
-		p2 = &V[j * 32];
+		p2 = scrypt_lookup1(Y, V, X[16] & 1023, gap);
 		for(k = 0; k < 32; k++)
 			p1[k] ^= p2[k];
 
 		salsa20_8(&X[0], &X[16]);
 		salsa20_8(&X[16], &X[0]);
 
-		j = X[16] & 1023;
-		p2 = &V[j * 32];
+		p2 = scrypt_lookup1(Y, V, X[16] & 1023, gap);
 		for(k = 0; k < 32; k++)
 			p1[k] ^= p2[k];
 
@@ -135,9 +158,10 @@ static inline void scrypt_core1(uint32_t *X, uint32_t *V)
 
 
 /* cpu and memory intensive function to transform a 80 byte buffer into a 32 byte output
-   scratchpad size needs to be at least 63 + (128 * r * p) + (256 * r + 64) + (128 * r * N) bytes
+   scratchpad size needs to be at least SCRYPT_SCRATCHBUF_SIZE(1, opt_lookup_gap) bytes
+   only output[7] is valid unless it is at most Htarg
  */
-static void scrypt_1024_1_1_256_sp1(const uint32_t* input, uint32_t* output, uint8_t* scratchpad)
+static inline void scrypt_1024_1_1_256_sp1_common(const PBKDF2_SHA256_80_CTX* ctx, const uint32_t* input, uint32_t* output, uint32_t Htarg, uint8_t* scratchpad, bool simd)
 {
 	uint32_t tstate[8], ostate[8];
 	uint32_t * B;
@@ -146,147 +170,569 @@ static void scrypt_1024_1_1_256_sp1(const uint32_t* input, uint32_t* output, uin
 	B = (uint32_t *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
 	V = (uint32_t *)(B + 32);
 
-	PBKDF2_SHA256_80_128_init(input, tstate, ostate);
-	PBKDF2_SHA256_80_128(tstate, ostate, input, B);
+	PBKDF2_SHA256_80_128_init(ctx, input, tstate, ostate);
+	PBKDF2_SHA256_80_128(ctx, tstate, ostate, input, B);
 
 #ifdef HAVE_SCRYPT_SIMD_HELPERS
-	scrypt_simd_core1(B, V);
-#else
-	scrypt_core1(B, V);
+	if (simd)
+		scrypt_simd_core1(B, V, opt_lookup_gap);
+	else
 #endif
+		scrypt_core1(B, V, opt_lookup_gap);
 
-	PBKDF2_SHA256_80_128_32(tstate, ostate, input, B, output);
+	PBKDF2_SHA256_80_128_32(ctx, tstate, ostate, input, B, output, Htarg);
 }
 
-int scanhash_scrypt1(int thr_id, unsigned char *pdata, uint8_t *scratchbuf,
-	const unsigned char *ptarget,
+static void
+scrypt_1024_1_1_256_sp1(const PBKDF2_SHA256_80_CTX * ctx,
+                        const uint32_t   input[1][20],
+                        uint32_t         output[1][8],
+                        uint32_t         Htarg,
+                        uint8_t        * scratchpad)
+{
+	scrypt_1024_1_1_256_sp1_common(ctx, input[0], output[0], Htarg,
+	                               scratchpad, false);
+}
+
+/*
+ * Word 7 of a hash is only a first check against the target, the whole
+ * hash has to be at most the target too. The kernels compute all of it
+ * when that word passes.
+ */
+static bool scrypt_hash_fulltest(const uint32_t hash[8],
+                                 const unsigned char *ptarget)
+{
+	unsigned char hash_le[32];
+	int i;
+
+	for (i = 0; i < 8; i++)
+		le32enc(hash_le + i * 4, hash[i]);
+	return fulltest(hash_le, ptarget);
+}
+
+#ifdef HAVE_SCRYPT_SIMD_HELPERS
+
+static void
+scrypt_1024_1_1_256_sp1_simd(const PBKDF2_SHA256_80_CTX * ctx,
+                             const uint32_t   input[1][20],
+                             uint32_t         output[1][8],
+                             uint32_t         Htarg,
+                             uint8_t        * scratchpad)
+{
+	scrypt_1024_1_1_256_sp1_common(ctx, input[0], output[0], Htarg,
+	                               scratchpad, true);
+}
+
+static void
+scrypt_1024_1_1_256_sp2(const PBKDF2_SHA256_80_CTX * ctx,
+                        const uint32_t   input[2][20],
+                        uint32_t         output[2][8],
+                        uint32_t         Htarg,
+                        uint8_t        * scratchpad)
+{
+	uint32_t tstate[2][8], ostate[2][8];
+	uint32_t * B;
+	uint32_t * V;
+	int k;
+
+	B = (uint32_t *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+	V = B + 2 * 32;
+
+	for (k = 0; k < 2; k++) {
+		PBKDF2_SHA256_80_128_init(ctx, input[k], tstate[k], ostate[k]);
+		PBKDF2_SHA256_80_128(ctx, tstate[k], ostate[k], input[k],
+		                     B + k * 32);
+	}
+
+	scrypt_simd_core2(B, V, opt_lookup_gap);
+
+	for (k = 0; k < 2; k++)
+		PBKDF2_SHA256_80_128_32(ctx, tstate[k], ostate[k], input[k],
+		                        B + k * 32, output[k], Htarg);
+}
+
+/*
+ * Hashes go through 'scrypt_simd_core2_staggered' as a pipeline, so every
+ * nonce is finished one iteration after it has been started.
+ */
+static bool scrypt_staggered_finish(const PBKDF2_SHA256_80_CTX * ctx,
+                                    uint32_t       * tstate,
+                                    uint32_t       * ostate,
+                                    const uint32_t * input,
+                                    const uint32_t * B, uint32_t Htarg,
+                                    const unsigned char * ptarget)
+{
+	uint32_t tmp_hash[8];
+
+	PBKDF2_SHA256_80_128_32(ctx, tstate, ostate, input, B, tmp_hash, Htarg);
+	return tmp_hash[7] <= Htarg && scrypt_hash_fulltest(tmp_hash, ptarget);
+}
+
+int scanhash_scrypt2_staggered(int thr_id, unsigned char *pdata,
+	unsigned char *scratchbuf, const unsigned char *ptarget,
 	uint32_t max_nonce, unsigned long *hashes_done)
 {
-	uint32_t data[20];
-	uint32_t tmp_hash[32];
-	uint32_t *nonce = (uint32_t *)(data + 19);
-	uint32_t n = 0;
+	PBKDF2_SHA256_80_CTX ctx;
+	uint32_t data[2][20];
+	uint32_t tstate[2][8], ostate[2][8];
+	uint32_t * B;
+	uint32_t * V;
+	uint32_t first_nonce = be32dec(pdata + 64 + 12);
+	uint32_t n = first_nonce;
 	uint32_t Htarg = le32dec(ptarget + 28);
-	int i;
+	int i, slot = 0;
+	bool prev;
+
+	B = (uint32_t *)(((uintptr_t)(scratchbuf) + 63) & ~ (uintptr_t)(63));
+	V = B + 2 * 32;
 
-	work_restart[thr_id].restart = 0;
-	
 	for (i = 0; i < 80/4; i++)
-		data[i] = be32dec(pdata + i * 4);
-	
+		data[0][i] = data[1][i] = be32dec(pdata + i * 4);
+	PBKDF2_SHA256_80_precalc(data[0], &ctx);
+
 	while(1) {
 		n++;
-		*nonce = n;
-		scrypt_1024_1_1_256_sp1(data, tmp_hash, scratchbuf);
-
-		if (tmp_hash[7] <= Htarg) {
-			be32enc(pdata + 64 + 12, n);
-			*hashes_done = n;
+		data[slot][19] = n;
+		PBKDF2_SHA256_80_128_init(&ctx, data[slot], tstate[slot],
+		                          ostate[slot]);
+		PBKDF2_SHA256_80_128(&ctx, tstate[slot], ostate[slot],
+		                     data[slot], B + slot * 32);
+
+		/* start nonce n and finish nonce n - 1 */
+		prev = n - 1 > first_nonce;
+		scrypt_simd_core2_staggered(B + slot * 32,
+		                            prev ? B + (slot ^ 1) * 32 : NULL,
+		                            V, slot, opt_lookup_gap);
+		if (prev && scrypt_staggered_finish(&ctx, tstate[slot ^ 1],
+		                                    ostate[slot ^ 1],
+		                                    data[slot ^ 1],
+		                                    B + (slot ^ 1) * 32, Htarg,
+		                                    ptarget)) {
+			be32enc(pdata + 64 + 12, n - 1);
+			*hashes_done = n - 1 - first_nonce;
 			return true;
 		}
 
-		if ((n >= max_nonce) || work_restart[thr_id].restart) {
-			*hashes_done = n;
+		if (n >= max_nonce) {
+			/* drain the pipeline */
+			scrypt_simd_core2_staggered(NULL, B + slot * 32,
+			                            V, slot ^ 1, opt_lookup_gap);
+			*hashes_done = n - first_nonce;
+			if (scrypt_staggered_finish(&ctx, tstate[slot],
+			                            ostate[slot], data[slot],
+			                            B + slot * 32, Htarg,
+			                            ptarget)) {
+				be32enc(pdata + 64 + 12, n);
+				return true;
+			}
+			break;
+		}
+
+		if (work_restart[thr_id].restart) {
+			*hashes_done = n - 1 - first_nonce;
 			break;
 		}
+
+		slot ^= 1;
 	}
 	return false;
 }
 
-#ifdef HAVE_SCRYPT_SIMD_HELPERS
+#endif
+
+#ifdef HAVE_SCRYPT_SIMD_CORE4
 
 static void
-scrypt_1024_1_1_256_sp2(const uint32_t * input1,
-                        uint32_t       * output1,
-                        const uint32_t * input2,
-                        uint32_t       * output2,
+scrypt_1024_1_1_256_sp4(const PBKDF2_SHA256_80_CTX * ctx,
+                        const uint32_t   input[4][20],
+                        uint32_t         output[4][8],
+                        uint32_t         Htarg,
                         uint8_t        * scratchpad)
 {
-	uint32_t tstate1[8], tstate2[8], ostate1[8], ostate2[8];
-	uint32_t * B1, * B2;
+	uint32x4 tstate[8], ostate[8];
+	const uint32_t * in[4], * salt[4];
+	uint32_t * out[4], * Bk[4];
+	uint32_t * B;
+	uint32_t * V;
+	int k;
+
+	B = (uint32_t *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+	V = B + 4 * 32;
+
+	for (k = 0; k < 4; k++) {
+		in[k] = input[k];
+		out[k] = output[k];
+		salt[k] = Bk[k] = B + k * 32;
+	}
+
+	PBKDF2_SHA256_80_128_init_4way(ctx, in, tstate, ostate);
+	PBKDF2_SHA256_80_128_4way(ctx, tstate, ostate, in, Bk);
+
+	scrypt_simd_core4(B, V, opt_lookup_gap);
+
+	PBKDF2_SHA256_80_128_32_4way(ctx, tstate, ostate, salt, out, Htarg);
+}
+
+#endif
+
+#ifdef HAVE_SCRYPT_SIMD_CORE8
+
+static void
+scrypt_1024_1_1_256_sp8(const PBKDF2_SHA256_80_CTX * ctx,
+                        const uint32_t   input[8][20],
+                        uint32_t         output[8][8],
+                        uint32_t         Htarg,
+                        uint8_t        * scratchpad)
+{
+	uint32x8 tstate[8], ostate[8];
+	const uint32_t * in[8], * salt[8];
+	uint32_t * out[8], * Bk[8];
+	uint32_t * B;
+	uint32_t * V;
+	int k;
+
+	B = (uint32_t *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+	V = B + 8 * 32;
+
+	for (k = 0; k < 8; k++) {
+		in[k] = input[k];
+		out[k] = output[k];
+		salt[k] = Bk[k] = B + k * 32;
+	}
+
+	PBKDF2_SHA256_80_128_init_8way(ctx, in, tstate, ostate);
+	PBKDF2_SHA256_80_128_8way(ctx, tstate, ostate, in, Bk);
+
+	scrypt_simd_core8(B, V, opt_lookup_gap);
+
+	PBKDF2_SHA256_80_128_32_8way(ctx, tstate, ostate, salt, out, Htarg);
+}
+
+/* Groups of eight hashes, see 'scrypt_simd_core8_pipelined' */
+#define PIPELINED_LANES (SCRYPT_PREFETCH_GROUPS * 8)
+#if PIPELINED_LANES > SCRYPT_MAX_LANES
+#error "SCRYPT_PREFETCH_GROUPS is too large"
+#endif
+
+static void
+scrypt_1024_1_1_256_sp8_pipelined(const PBKDF2_SHA256_80_CTX * ctx,
+                                  const uint32_t   input[PIPELINED_LANES][20],
+                                  uint32_t         output[PIPELINED_LANES][8],
+                                  uint32_t         Htarg,
+                                  uint8_t        * scratchpad)
+{
+	uint32x8 tstate[SCRYPT_PREFETCH_GROUPS][8];
+	uint32x8 ostate[SCRYPT_PREFETCH_GROUPS][8];
+	const uint32_t * in[PIPELINED_LANES], * salt[PIPELINED_LANES];
+	uint32_t * out[PIPELINED_LANES], * Bk[PIPELINED_LANES];
+	uint32_t * B;
 	uint32_t * V;
+	int g, k;
 
-	B1 = (uint32_t *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
-	B2 = B1 + 32;
-	V  = B2 + 32;
+	B = (uint32_t *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+	V = B + PIPELINED_LANES * 32;
+
+	for (k = 0; k < PIPELINED_LANES; k++) {
+		in[k] = input[k];
+		out[k] = output[k];
+		salt[k] = Bk[k] = B + k * 32;
+	}
 
-	PBKDF2_SHA256_80_128_init(input1, tstate1, ostate1);
-	PBKDF2_SHA256_80_128_init(input2, tstate2, ostate2);
-	PBKDF2_SHA256_80_128(tstate1, ostate1, input1, B1);
-	PBKDF2_SHA256_80_128(tstate2, ostate2, input2, B2);
+	for (g = 0; g < SCRYPT_PREFETCH_GROUPS; g++) {
+		PBKDF2_SHA256_80_128_init_8way(ctx, &in[g * 8],
+		                               tstate[g], ostate[g]);
+		PBKDF2_SHA256_80_128_8way(ctx, tstate[g], ostate[g],
+		                          &in[g * 8], &Bk[g * 8]);
+	}
 
-	scrypt_simd_core2(B1, V);
+	scrypt_simd_core8_pipelined(B, V, opt_lookup_gap);
 
-	PBKDF2_SHA256_80_128_32(tstate1, ostate1, input1, B1, output1);
-	PBKDF2_SHA256_80_128_32(tstate2, ostate2, input2, B2, output2);
+	for (g = 0; g < SCRYPT_PREFETCH_GROUPS; g++)
+		PBKDF2_SHA256_80_128_32_8way(ctx, tstate[g], ostate[g],
+		                             &salt[g * 8], &out[g * 8], Htarg);
 }
 
-int scanhash_scrypt2(int thr_id, unsigned char *pdata, unsigned char *scratchbuf,
+#endif
+
+#ifdef HAVE_SCRYPT_SIMD_CORE16
+
+static void
+scrypt_1024_1_1_256_sp16(const PBKDF2_SHA256_80_CTX * ctx,
+                         const uint32_t   input[16][20],
+                         uint32_t         output[16][8],
+                         uint32_t         Htarg,
+                         uint8_t        * scratchpad)
+{
+	uint32x8 tstate[2][8], ostate[2][8];
+	const uint32_t * in[16], * salt[16];
+	uint32_t * out[16], * Bk[16];
+	uint32_t * B;
+	uint32_t * V;
+	int k;
+
+	B = (uint32_t *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+	V = B + 16 * 32;
+
+	for (k = 0; k < 16; k++) {
+		in[k] = input[k];
+		out[k] = output[k];
+		salt[k] = Bk[k] = B + k * 32;
+	}
+
+	/* PBKDF2 goes in two passes of eight lanes */
+	for (k = 0; k < 2; k++) {
+		PBKDF2_SHA256_80_128_init_8way(ctx, &in[k * 8],
+		                               tstate[k], ostate[k]);
+		PBKDF2_SHA256_80_128_8way(ctx, tstate[k], ostate[k],
+		                          &in[k * 8], &Bk[k * 8]);
+	}
+
+	scrypt_simd_core16(B, V, opt_lookup_gap);
+
+	for (k = 0; k < 2; k++)
+		PBKDF2_SHA256_80_128_32_8way(ctx, tstate[k], ostate[k],
+		                             &salt[k * 8], &out[k * 8], Htarg);
+}
+
+#endif
+
+/*
+ * Check word 7 of the hashes of all the lanes against the target at once,
+ * bit k of the result is set if lane k has found a share.
+ */
+static inline uint32_t
+scrypt_lanes_found(uint32_t output[][8], int lanes, uint32_t Htarg)
+{
+	uint32_t found = 0;
+	int k = 0;
+
+#ifdef __AVX512F__
+	const __m512i htarg = _mm512_set1_epi32(Htarg);
+	const __m512i hash7_idx = _mm512_setr_epi32(
+		0 * 8 + 7,  1 * 8 + 7,  2 * 8 + 7,  3 * 8 + 7,
+		4 * 8 + 7,  5 * 8 + 7,  6 * 8 + 7,  7 * 8 + 7,
+		8 * 8 + 7,  9 * 8 + 7, 10 * 8 + 7, 11 * 8 + 7,
+		12 * 8 + 7, 13 * 8 + 7, 14 * 8 + 7, 15 * 8 + 7);
+
+	for (; k + 16 <= lanes; k += 16)
+		found |= (uint32_t)_mm512_cmple_epu32_mask(
+			_mm512_i32gather_epi32(hash7_idx, output[k], 4),
+			htarg) << k;
+#endif
+	for (; k < lanes; k++)
+		found |= (uint32_t)(output[k][7] <= Htarg) << k;
+	return found;
+}
+
+/*
+ * The scanhash loop shared by all the kernels, which hash 'impl->lanes'
+ * consecutive nonces at once.
+ */
+static int scanhash_scrypt_lanes(const struct scrypt_impl *impl, int thr_id,
+	unsigned char *pdata, unsigned char *scratchbuf,
 	const unsigned char *ptarget,
 	uint32_t max_nonce, unsigned long *hashes_done)
 {
-	uint32_t data1[20];
-	uint32_t tmp_hash1[8];
-	uint32_t data2[20];
-	uint32_t tmp_hash2[8];
-	uint32_t *nonce1 = (uint32_t *)(data1 + 19);
-	uint32_t *nonce2 = (uint32_t *)(data2 + 19);
-	uint32_t n = 0;
+	PBKDF2_SHA256_80_CTX ctx;
+	uint32_t data[SCRYPT_MAX_LANES][20];
+	uint32_t tmp_hash[SCRYPT_MAX_LANES][8];
+	uint32_t first_nonce = be32dec(pdata + 64 + 12);
+	uint32_t n = first_nonce;
 	uint32_t Htarg = le32dec(ptarget + 28);
-	int i;
+	uint32_t found;
+	int lanes = impl->lanes;
+	int i, k;
 
-	work_restart[thr_id].restart = 0;
-	
 	for (i = 0; i < 80/4; i++) {
-		((uint32_t *)data1)[i] = be32dec(pdata + i * 4);
-		((uint32_t *)data2)[i] = be32dec(pdata + i * 4);
+		uint32_t w = be32dec(pdata + i * 4);
+		for (k = 0; k < lanes; k++)
+			data[k][i] = w;
 	}
-	
-	while(1) {
-		*nonce1 = n + 1;
-		*nonce2 = n + 2;
-		scrypt_1024_1_1_256_sp2(data1, tmp_hash1, data2, tmp_hash2, scratchbuf);
+	PBKDF2_SHA256_80_precalc(data[0], &ctx);
 
-		if (tmp_hash1[7] <= Htarg) {
-			be32enc(pdata + 64 + 12, n + 1);
-			*hashes_done = n + 1;
-			return true;
-		}
-
-		if (tmp_hash2[7] <= Htarg && n + 2 <= max_nonce) {
-			be32enc(pdata + 64 + 12, n + 2);
-			*hashes_done = n + 2;
+	while(1) {
+		for (k = 0; k < lanes; k++)
+			data[k][19] = n + k + 1;
+		impl->hash(&ctx, (const uint32_t (*)[20])data, tmp_hash, Htarg,
+		           scratchbuf);
+
+		found = scrypt_lanes_found(tmp_hash, lanes, Htarg);
+		if (max_nonce - n < (uint32_t)lanes)
+			found &= (1u << (max_nonce - n)) - 1;
+		for (; found; found &= found - 1) {
+			for (k = 0; !(found & (1u << k)); k++)
+				;
+			if (!scrypt_hash_fulltest(tmp_hash[k], ptarget))
+				continue;
+			be32enc(pdata + 64 + 12, n + k + 1);
+			*hashes_done = n + k + 1 - first_nonce;
 			return true;
 		}
 
-		n += 2;
-
-		if (n >= max_nonce) {
-			*hashes_done = max_nonce;
+		/* so that 'n' cannot wrap around near the top of the range */
+		if (max_nonce - n <= (uint32_t)lanes) {
+			*hashes_done = max_nonce - first_nonce;
 			break;
 		}
 
+		n += lanes;
+
 		if (work_restart[thr_id].restart) {
-			*hashes_done = n;
+			*hashes_done = n - first_nonce;
 			break;
 		}
 	}
 	return false;
 }
 
+/*
+ * All the scanhash implementations available in this build, from the
+ * narrowest to the widest. Unless overridden by the command line option
+ * or by the startup benchmark, the widest one is used.
+ */
+const struct scrypt_impl scrypt_impls[] = {
+	{ .name = "scalar", .lanes = 1,
+	  .hash = scrypt_1024_1_1_256_sp1 },
+#ifdef HAVE_SCRYPT_SIMD_HELPERS
+	{ .name = "simd1", .lanes = 1,
+	  .hash = scrypt_1024_1_1_256_sp1_simd },
+	{ .name = "simd2", .lanes = 2,
+	  .hash = scrypt_1024_1_1_256_sp2 },
+	{ .name = "simd2-staggered", .lanes = 2,
+	  .scanhash = scanhash_scrypt2_staggered },
+#endif
+#ifdef HAVE_SCRYPT_SIMD_CORE4
+	{ .name = "sse2-4way", .lanes = 4,
+	  .hash = scrypt_1024_1_1_256_sp4 },
+#endif
+#ifdef HAVE_SCRYPT_SIMD_CORE8
+	{ .name = "avx2-8way", .lanes = 8,
+	  .hash = scrypt_1024_1_1_256_sp8 },
+	{ .name = "avx2-8way-pipelined", .lanes = PIPELINED_LANES,
+	  .hash = scrypt_1024_1_1_256_sp8_pipelined },
+#endif
+#ifdef HAVE_SCRYPT_SIMD_CORE16
+	{ .name = "avx512-16way", .lanes = 16,
+	  .hash = scrypt_1024_1_1_256_sp16 },
+#endif
+	{ .name = NULL }
+};
+
+const struct scrypt_impl *scrypt_impl =
+	&scrypt_impls[ARRAY_SIZE(scrypt_impls) - 2];
+
+const struct scrypt_impl *scrypt_find_impl(const char *name)
+{
+	const struct scrypt_impl *impl;
+
+	for (impl = scrypt_impls; impl->name; impl++)
+		if (!strcmp(impl->name, name))
+			return impl;
+
+	return NULL;
+}
+
+/*
+ * SHA-256 for the PBKDF2 parts. The SHA extensions are used by default
+ * when the CPU has them, but they are not always a win in practice (e.g.
+ * when a hypervisor traps them), so the caller can benchmark and decide.
+ */
+bool scrypt_sha256_shani_usable(void)
+{
+#ifdef HAVE_SHA256_SHANI
+	return SHA256_shani_usable();
+#else
+	return false;
+#endif
+}
+
+void scrypt_sha256_use_shani(bool enable)
+{
+#ifdef HAVE_SHA256_SHANI
+	sha256_use_shani = enable && SHA256_shani_usable();
 #endif
+}
+
+/* SHA-256 of a whole message, as big endian words */
+static void sha256_msg(uint32_t S[8], const unsigned char *data, int len)
+{
+	unsigned char tail[128];
+	uint32_t block[16];
+	int i, r;
+
+	SHA256_InitState(S);
+	for (r = len; r >= 64; r -= 64, data += 64) {
+		for (i = 0; i < 16; i++)
+			block[i] = be32dec(data + i * 4);
+		SHA256_Transform(S, block, 0);
+	}
+
+	/* the padding takes one more block, or two */
+	memset(tail, 0, sizeof(tail));
+	memcpy(tail, data, r);
+	tail[r] = 0x80;
+	r = r < 56 ? 64 : 128;
+	be32enc(tail + r - 8, (uint32_t)((uint64_t)len >> 29));
+	be32enc(tail + r - 4, (uint32_t)len << 3);
+	for (data = tail; data < tail + r; data += 64) {
+		for (i = 0; i < 16; i++)
+			block[i] = be32dec(data + i * 4);
+		SHA256_Transform(S, block, 0);
+	}
+}
+
+/* double SHA-256, for the coinbase and the merkle tree */
+void sha256d(unsigned char *hash, const unsigned char *data, int len)
+{
+	uint32_t S[8];
+	int i;
+
+	sha256_msg(S, data, len);
+	for (i = 0; i < 8; i++)
+		be32enc(hash + i * 4, S[i]);
+	sha256_msg(S, hash, 32);
+	for (i = 0; i < 8; i++)
+		be32enc(hash + i * 4, S[i]);
+}
+
+int scrypt_impl_scanhash(const struct scrypt_impl *impl, int thr_id,
+	unsigned char *pdata, unsigned char *scratchbuf,
+	const unsigned char *ptarget,
+	uint32_t max_nonce, unsigned long *hashes_done)
+{
+	if (!impl->hash)
+		return impl->scanhash(thr_id, pdata, scratchbuf, ptarget,
+		                      max_nonce, hashes_done);
+	return scanhash_scrypt_lanes(impl, thr_id, pdata, scratchbuf, ptarget,
+	                             max_nonce, hashes_done);
+}
 
 int scanhash_scrypt(int thr_id, unsigned char *pdata, unsigned char *scratchbuf,
 	const unsigned char *ptarget,
 	uint32_t max_nonce, unsigned long *hashes_done)
 {
-	/*
-	 * TODO: maybe add a command line option or run benchmarks at start
-	 * to select the fastest implementation?
-	 */
-#ifdef HAVE_SCRYPT_SIMD_HELPERS
-	return scanhash_scrypt2(thr_id, pdata, scratchbuf, ptarget, max_nonce, hashes_done);
-#else
-	return scanhash_scrypt1(thr_id, pdata, scratchbuf, ptarget, max_nonce, hashes_done);
-#endif
+	return scrypt_impl_scanhash(scrypt_impl, thr_id, pdata, scratchbuf,
+	                            ptarget, max_nonce, hashes_done);
+}
+
+/*
+ * The Cell SPU kernel only compares word 7 of a hash with the target, so
+ * its shares are hashed again in full with the scalar kernel to be checked
+ * against the whole target before they are submitted.
+ */
+bool scrypt_fulltest(const unsigned char *pdata, unsigned char *scratchbuf,
+	const unsigned char *ptarget)
+{
+	PBKDF2_SHA256_80_CTX ctx;
+	uint32_t data[1][20];
+	uint32_t hash[1][8];
+	int i;
+
+	for (i = 0; i < 80/4; i++)
+		data[0][i] = be32dec(pdata + i * 4);
+	PBKDF2_SHA256_80_precalc(data[0], &ctx);
+	scrypt_1024_1_1_256_sp1(&ctx, (const uint32_t (*)[20])data, hash,
+	                        0xffffffff, scratchbuf);
+
+	return scrypt_hash_fulltest(hash[0], ptarget);
 }
@@ -111,12 +111,32 @@ typedef struct SHA256Context {
 	    S[(70 - i) % 8], S[(71 - i) % 8],	\
 	    W[i] + k)
 
+/* SHA256 round constants */
+static const uint32_t sha256_k[64] __attribute__((aligned(16))) = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
 /*
  * SHA256 block compression function.  The 256-bit state is transformed via
  * the 512-bit input block to produce a new state.
  */
 static void
-SHA256_Transform(uint32_t * state, const uint32_t block[16], int swap)
+SHA256_Transform_scalar(uint32_t * state, const uint32_t block[16], int swap)
 {
 	uint32_t W[64];
 	uint32_t S[8];
@@ -207,6 +227,120 @@ SHA256_Transform(uint32_t * state, const uint32_t block[16], int swap)
 		state[i] += S[i];
 }
 
+/*
+ * The same using the x86 SHA extensions. It is compiled regardless of the
+ * compiler flags and only used if the CPU turns out to support it.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+
+#define HAVE_SHA256_SHANI
+
+#include <immintrin.h>
+#include <cpuid.h>
+
+static void __attribute__((target("sha,ssse3,sse4.1")))
+SHA256_Transform_shani(uint32_t * state, const uint32_t block[16], int swap)
+{
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+	                                    0x0405060700010203ULL);
+	__m128i S0, S1, S0_save, S1_save, msg, tmp, W[4];
+	int i;
+
+	/* The instructions want the state as ABEF and CDGH */
+	tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xb1);
+	S1  = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1b);
+	S0  = _mm_alignr_epi8(tmp, S1, 8);
+	S1  = _mm_blend_epi16(S1, tmp, 0xf0);
+	S0_save = S0;
+	S1_save = S1;
+
+	for (i = 0; i < 4; i++) {
+		W[i] = _mm_loadu_si128((const __m128i *)&block[i * 4]);
+		if (swap)
+			W[i] = _mm_shuffle_epi8(W[i], mask);
+	}
+
+	/* Four rounds per iteration, extending the message schedule on the go */
+#if !defined(__clang__) && (__GNUC__ >= 8)
+#pragma GCC unroll 16
+#endif
+	for (i = 0; i < 16; i++) {
+		msg = _mm_add_epi32(W[i & 3],
+		                    _mm_load_si128((const __m128i *)&sha256_k[i * 4]));
+		S1 = _mm_sha256rnds2_epu32(S1, S0, msg);
+		if (i >= 3 && i < 15) {
+			tmp = _mm_alignr_epi8(W[i & 3], W[(i - 1) & 3], 4);
+			W[(i + 1) & 3] = _mm_add_epi32(W[(i + 1) & 3], tmp);
+			W[(i + 1) & 3] = _mm_sha256msg2_epu32(W[(i + 1) & 3], W[i & 3]);
+		}
+		msg = _mm_shuffle_epi32(msg, 0x0e);
+		S0 = _mm_sha256rnds2_epu32(S0, S1, msg);
+		if (i >= 1 && i < 13)
+			W[(i - 1) & 3] = _mm_sha256msg1_epu32(W[(i - 1) & 3], W[i & 3]);
+	}
+
+	S0 = _mm_add_epi32(S0, S0_save);
+	S1 = _mm_add_epi32(S1, S1_save);
+
+	/* Back to ABCD and EFGH */
+	tmp = _mm_shuffle_epi32(S0, 0x1b);
+	S1  = _mm_shuffle_epi32(S1, 0xb1);
+	_mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, S1, 0xf0));
+	_mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(S1, tmp, 8));
+}
+
+/*
+ * Check the CPU for the SHA extensions and, to be on the safe side, that
+ * the results agree with the scalar code in both byte orders.
+ */
+static int
+SHA256_shani_usable(void)
+{
+	uint32_t block[16], st1[8], st2[8];
+	unsigned int a, b, c, d;
+	int i, swap;
+
+	if (!__get_cpuid(1, &a, &b, &c, &d) ||
+	    !(c & bit_SSSE3) || !(c & bit_SSE4_1))
+		return 0;
+	if (__get_cpuid_max(0, NULL) < 7)
+		return 0;
+	__cpuid_count(7, 0, a, b, c, d);
+	if (!(b & (1 << 29)))
+		return 0;
+
+	for (i = 0; i < 16; i++)
+		block[i] = 0x9e3779b9 * (i + 1);
+	for (swap = 0; swap < 2; swap++) {
+		for (i = 0; i < 8; i++)
+			st1[i] = st2[i] = 0x7f4a7c15u * (i + swap + 1);
+		SHA256_Transform_scalar(st1, block, swap);
+		SHA256_Transform_shani(st2, block, swap);
+		if (memcmp(st1, st2, sizeof(st1)))
+			return 0;
+	}
+	return 1;
+}
+
+static int sha256_use_shani = -1;
+
+#endif
+
+static inline void
+SHA256_Transform(uint32_t * state, const uint32_t block[16], int swap)
+{
+#ifdef HAVE_SHA256_SHANI
+	if (__builtin_expect(sha256_use_shani < 0, 0))
+		sha256_use_shani = SHA256_shani_usable();
+	if (sha256_use_shani) {
+		SHA256_Transform_shani(state, block, swap);
+		return;
+	}
+#endif
+	SHA256_Transform_scalar(state, block, swap);
+}
+
 static inline void
 SHA256_InitState(uint32_t * state)
 {
@@ -221,21 +355,164 @@ SHA256_InitState(uint32_t * state)
 	state[7] = 0x5BE0CD19;
 }
 
+/*
+ * Most of the PBKDF2 blocks differ only in the nonce or in the block counter,
+ * so a part of their message schedule and the first rounds that only depend
+ * on the invariant words can be precomputed, the same trick that bitcoin
+ * miners use for the block header. These are scalar, so with SHA-NI whole
+ * blocks are faster.
+ */
+
+/* Extend the message schedule W from the word 'first' on */
+static inline void
+SHA256_Schedule(uint32_t W[64], int first)
+{
+	int i;
+
+	for (i = first; i < 64; i++)
+		W[i] = s1(W[i - 2]) + W[i - 7] + s0(W[i - 15]) + W[i - 16];
+}
+
+/* Run the rounds from 'first' to 'last' - 1 on the working variables S */
+static inline void
+SHA256_Rounds(uint32_t S[8], const uint32_t *W, int first, int last)
+{
+	uint32_t a = S[0], b = S[1], c = S[2], d = S[3];
+	uint32_t e = S[4], f = S[5], g = S[6], h = S[7];
+	uint32_t t0, t1;
+	int i;
+
+#if !defined(__clang__) && (__GNUC__ >= 8)
+#pragma GCC unroll 64
+#endif
+	for (i = first; i < last; i++) {
+		t0 = h + S1(e) + Ch(e, f, g) + W[i] + sha256_k[i];
+		t1 = S0(a) + Maj(a, b, c);
+		h = g; g = f; f = e; e = d + t0;
+		d = c; c = b; b = a; a = t0 + t1;
+	}
+
+	S[0] = a; S[1] = b; S[2] = c; S[3] = d;
+	S[4] = e; S[5] = f; S[6] = g; S[7] = h;
+}
+
+/*
+ * Finish a block compression. W is the complete message schedule and S is
+ * what the first 'first' rounds made of 'state'.
+ */
+static inline void
+SHA256_Transform_partial(uint32_t state[8], const uint32_t S[8], const uint32_t W[64], int first)
+{
+	uint32_t T[8];
+	int i;
+
+	memcpy(T, S, 32);
+	SHA256_Rounds(T, W, first, 64);
+	for (i = 0; i < 8; i++)
+		state[i] += T[i];
+}
+
+/*
+ * Compute only the last word of the new state. The final 'h' is the 'e'
+ * made by round 60, so the last three rounds are not needed.
+ */
+static inline uint32_t
+SHA256_Transform_word7(const uint32_t state[8], const uint32_t block[16])
+{
+	uint32_t W[64], S[8];
+	int i;
+
+	memcpy(W, block, 64);
+	for (i = 16; i < 61; i++)
+		W[i] = s1(W[i - 2]) + W[i - 7] + s0(W[i - 15]) + W[i - 16];
+	memcpy(S, state, 32);
+	SHA256_Rounds(S, W, 0, 61);
+	return state[7] + S[4];
+}
+
+static inline int
+SHA256_partial_preferred(void)
+{
+#ifdef HAVE_SHA256_SHANI
+	if (__builtin_expect(sha256_use_shani < 0, 0))
+		sha256_use_shani = SHA256_shani_usable();
+	return !sha256_use_shani;
+#else
+	return 1;
+#endif
+}
+
 static const uint32_t passwdpad[12] = {0x00000080, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x80020000};
+static const uint32_t innerpad[11] = {0x00000080, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xa0040000};
 static const uint32_t outerpad[8] = {0x80000000, 0, 0, 0, 0, 0, 0, 0x00000300};
+static const uint32_t ihash_finalblk[16] = {0x00000001,0x80000000,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0x00000620};
+
+/*
+ * Within one work unit only the nonce (the last word of the 80 byte header)
+ * changes, so everything that does not depend on it is computed once per
+ * work and shared by all the nonces.
+ */
+typedef struct PBKDF2Context {
+	/* SHA256 midstate of the first 64 bytes of the header */
+	uint32_t midstate[8];
+	/* The second block of the header, with word 3 (the nonce) left out */
+	uint32_t tailW[18];
+	uint32_t tailS[8];	/* 'midstate' after the rounds 0 - 2 */
+	/* The first 64 bytes of the header hashed again under the HMAC key */
+	uint32_t headW[64];
+	/* The inner HMAC blocks, with words 3 and 4 (the counter) left out */
+	uint32_t innerW[18];
+	/* The constant last block of PBKDF2_SHA256_80_128_32 */
+	uint32_t finalW[64];
+} PBKDF2_SHA256_80_CTX;
 
 static inline void
-PBKDF2_SHA256_80_128_init(const uint32_t *passwd, uint32_t tstate[8], uint32_t ostate[8])
+PBKDF2_SHA256_80_precalc(const uint32_t *passwd, PBKDF2_SHA256_80_CTX *ctx)
+{
+	SHA256_InitState(ctx->midstate);
+	SHA256_Transform(ctx->midstate, passwd, 1);
+
+	byteswap_vec(ctx->tailW, passwd+16, 3);
+	ctx->tailW[3] = 0;
+	byteswap_vec(ctx->tailW+4, passwdpad, 12);
+	ctx->tailW[16] = s1(ctx->tailW[14]) + ctx->tailW[9] + s0(ctx->tailW[1]) + ctx->tailW[0];
+	ctx->tailW[17] = s1(ctx->tailW[15]) + ctx->tailW[10] + s0(ctx->tailW[2]) + ctx->tailW[1];
+	memcpy(ctx->tailS, ctx->midstate, 32);
+	SHA256_Rounds(ctx->tailS, ctx->tailW, 0, 3);
+
+	byteswap_vec(ctx->headW, passwd, 16);
+	SHA256_Schedule(ctx->headW, 16);
+
+	byteswap_vec(ctx->innerW, passwd+16, 3);
+	ctx->innerW[3] = ctx->innerW[4] = 0;
+	byteswap_vec(ctx->innerW+5, innerpad, 11);
+	ctx->innerW[16] = s1(ctx->innerW[14]) + ctx->innerW[9] + s0(ctx->innerW[1]) + ctx->innerW[0];
+	ctx->innerW[17] = s1(ctx->innerW[15]) + ctx->innerW[10] + s0(ctx->innerW[2]) + ctx->innerW[1];
+
+	memcpy(ctx->finalW, ihash_finalblk, 64);
+	SHA256_Schedule(ctx->finalW, 16);
+}
+
+static inline void
+PBKDF2_SHA256_80_128_init(const PBKDF2_SHA256_80_CTX *ctx, const uint32_t *passwd, uint32_t tstate[8], uint32_t ostate[8])
 {
 	uint32_t ihash[8];
 	uint32_t pad[16];
 	uint32_t i;
 
-	SHA256_InitState(tstate);
-	SHA256_Transform(tstate, passwd, 1);
-	memcpy(pad, passwd+16, 16);
-	memcpy(pad+4, passwdpad, 48);
-	SHA256_Transform(tstate, pad, 1);
+	memcpy(tstate, ctx->midstate, 32);
+	if (SHA256_partial_preferred()) {
+		uint32_t W[64];
+
+		memcpy(W, ctx->tailW, sizeof(ctx->tailW));
+		W[3] = byteswap(passwd[19]);
+		SHA256_Schedule(W, 18);
+		SHA256_Transform_partial(tstate, ctx->tailS, W, 3);
+	} else {
+		memcpy(pad, passwd+16, 16);
+		memcpy(pad+4, passwdpad, 48);
+		SHA256_Transform(tstate, pad, 1);
+	}
 	memcpy(ihash, tstate, 32);
 
 	SHA256_InitState(ostate);
@@ -259,11 +536,12 @@ PBKDF2_SHA256_80_128_init(const uint32_t *passwd, uint32_t tstate[8], uint32_t o
  * write the output to buf.
  */
 static inline void
-PBKDF2_SHA256_80_128(const uint32_t *tstate, const uint32_t *ostate, const uint32_t *passwd, uint32_t *buf)
+PBKDF2_SHA256_80_128(const PBKDF2_SHA256_80_CTX *ctx, const uint32_t *tstate, const uint32_t *ostate, const uint32_t *passwd, uint32_t *buf)
 {
-	static const uint32_t innerpad[11] = {0x00000080, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xa0040000};
 	SHA256_CTX PShictx, PShoctx;
+	uint32_t W[64], S[8];
 	uint32_t i;
+	int partial = SHA256_partial_preferred();
 	
 	/* If Klen > 64, the key is really SHA256(K). */
 	memcpy(PShictx.state, tstate, 32);
@@ -271,9 +549,20 @@ PBKDF2_SHA256_80_128(const uint32_t *tstate, const uint32_t *ostate, const uint3
 	
 	memcpy(PShoctx.buf+8, outerpad, 32);
 
-	SHA256_Transform(PShictx.state, passwd, 1);
-	byteswap_vec(PShictx.buf, passwd+16, 4);
-	byteswap_vec(PShictx.buf+5, innerpad, 11);
+	if (partial) {
+		SHA256_Transform_partial(PShictx.state, PShictx.state, ctx->headW, 0);
+
+		/* the rounds 0 - 3 are the same for all the blocks */
+		memcpy(W, ctx->innerW, sizeof(ctx->innerW));
+		W[3] = byteswap(passwd[19]);
+		W[18] = s1(W[16]) + W[11] + s0(W[3]) + W[2];
+		memcpy(S, PShictx.state, 32);
+		SHA256_Rounds(S, W, 0, 4);
+	} else {
+		SHA256_Transform(PShictx.state, passwd, 1);
+		byteswap_vec(PShictx.buf, passwd+16, 4);
+		byteswap_vec(PShictx.buf+5, innerpad, 11);
+	}
 
 	/* Iterate through the blocks. */
 	for (i = 0; i < 4; i++) {
@@ -281,8 +570,14 @@ PBKDF2_SHA256_80_128(const uint32_t *tstate, const uint32_t *ostate, const uint3
 		uint32_t ost[8];
 		
 		memcpy(ist, PShictx.state, 32);
-		PShictx.buf[4] = i + 1;
-		SHA256_Transform(ist, PShictx.buf, 0);
+		if (partial) {
+			W[4] = i + 1;
+			SHA256_Schedule(W, 19);
+			SHA256_Transform_partial(ist, S, W, 4);
+		} else {
+			PShictx.buf[4] = i + 1;
+			SHA256_Transform(ist, PShictx.buf, 0);
+		}
 		memcpy(PShoctx.buf, ist, 32);
 
 		memcpy(ost, PShoctx.state, 32);
@@ -291,19 +586,31 @@ PBKDF2_SHA256_80_128(const uint32_t *tstate, const uint32_t *ostate, const uint3
 	}
 }
 
+/*
+ * Only 'output[7]' is compared with the target, so the rest of the output
+ * is only computed when that word is not above 'Htarg'.
+ */
 static inline void
-PBKDF2_SHA256_80_128_32(uint32_t *tstate, uint32_t *ostate, const uint32_t *passwd, const uint32_t *salt, uint32_t *output)
+PBKDF2_SHA256_80_128_32(const PBKDF2_SHA256_80_CTX *ctx, uint32_t *tstate, uint32_t *ostate, const uint32_t *passwd, const uint32_t *salt, uint32_t *output, uint32_t Htarg)
 {
-	static const uint32_t ihash_finalblk[16] = {0x00000001,0x80000000,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0x00000620};
 	uint32_t pad[16];
 	uint32_t i;
+	int partial = SHA256_partial_preferred();
 	
 	SHA256_Transform(tstate, salt, 1);
 	SHA256_Transform(tstate, salt+16, 1);
-	SHA256_Transform(tstate, ihash_finalblk, 0);
+	if (partial)
+		SHA256_Transform_partial(tstate, tstate, ctx->finalW, 0);
+	else
+		SHA256_Transform(tstate, ihash_finalblk, 0);
 	memcpy(pad, tstate, 32);
 	memcpy(pad+8, outerpad, 32);
 
+	if (partial) {
+		output[7] = byteswap(SHA256_Transform_word7(ostate, pad));
+		if (output[7] > Htarg)
+			return;
+	}
 	SHA256_Transform(ostate, pad, 0);
 	
 	for (i = 0; i < 8; i++)
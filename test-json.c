@@ -0,0 +1,65 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * The replies of the server the miner has to parse with the jansson it is
+ * built with, which may be the bundled one with only int for integers.
+ */
+
+#include "cpuminer-config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <jansson.h>
+#include <curl/curl.h>
+#include "compat.h"
+#include "miner.h"
+
+/* the 50 coin subsidy of regtest and testnet, in satoshis */
+static const char *gbt_reply =
+	"{\"result\": {\"version\": 536870912, \"previousblockhash\": "
+	"\"0f9188f13cb7b2c71f2a335e3a4fc328bf5beb436012afca590b1a11466e2206\", "
+	"\"transactions\": [], \"coinbasevalue\": 5000000000, "
+	"\"bits\": \"207fffff\", \"curtime\": 1700000000, \"height\": 1, "
+	"\"target\": "
+	"\"7fffff0000000000000000000000000000000000000000000000000000000000\"}, "
+	"\"error\": null, \"id\": 0}";
+
+static bool test_gbt_coinbasevalue(void)
+{
+	json_error_t err;
+	json_t *val, *res, *value;
+	bool rc;
+
+	val = JSON_LOADS(gbt_reply, &err);
+	if (!val) {
+		fprintf(stderr, "getblocktemplate reply: %s\n", err.text);
+		return false;
+	}
+
+	res = json_object_get(val, "result");
+	value = json_object_get(res, "coinbasevalue");
+	rc = json_is_number(value) &&
+	     (int64_t) json_number_value(value) == 5000000000LL &&
+	     json_is_integer(json_object_get(res, "curtime")) &&
+	     json_is_integer(json_object_get(res, "height"));
+	if (!rc)
+		fprintf(stderr, "getblocktemplate reply: coinbasevalue "
+			"5000000000 read as %.0f\n", json_number_value(value));
+
+	json_decref(val);
+	return rc;
+}
+
+int main(void)
+{
+	if (!test_gbt_coinbasevalue())
+		return 1;
+	return 0;
+}
@@ -19,29 +19,35 @@
 #include <jansson.h>
 #include <curl/curl.h>
 #include <time.h>
+#include <errno.h>
+#ifndef WIN32
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 #include "miner.h"
 #include "elist.h"
 
-#if JANSSON_MAJOR_VERSION >= 2
-#define JSON_LOADS(str, err_ptr) json_loads((str), 0, (err_ptr))
-#else
-#define JSON_LOADS(str, err_ptr) json_loads((str), (err_ptr))
-#endif
-
 struct data_buffer {
 	void		*buf;
 	size_t		len;
+	size_t		size;		/* allocated size */
 };
 
-struct upload_buffer {
-	const void	*buf;
-	size_t		len;
-};
+/* the smallest receive buffer, it doubles from there as needed */
+#define DATA_BUFFER_MIN	4096
 
 struct header_info {
 	char		*lp_path;
+	int		rolltime;	/* from X-Roll-NTime, 0 if none */
 };
 
+/* how long ntime may be rolled for a plain "X-Roll-NTime: Y" */
+#define DEF_ROLLTIME	60
+
 struct tq_ent {
 	void			*data;
 	struct list_head	q_node;
@@ -119,11 +125,18 @@ static size_t all_data_cb(const void *ptr, size_t size, size_t nmemb,
 	oldlen = db->len;
 	newlen = oldlen + len;
 
-	newmem = realloc(db->buf, newlen + 1);
-	if (!newmem)
-		return 0;
+	if (newlen + 1 > db->size) {
+		size_t newsize = db->size ? db->size : DATA_BUFFER_MIN;
+
+		while (newsize < newlen + 1)
+			newsize *= 2;
+		newmem = realloc(db->buf, newsize);
+		if (!newmem)
+			return 0;
+		db->buf = newmem;
+		db->size = newsize;
+	}
 
-	db->buf = newmem;
 	db->len = newlen;
 	memcpy(db->buf + oldlen, ptr, len);
 	memcpy(db->buf + newlen, &zero, 1);	/* null terminate */
@@ -131,94 +144,88 @@ static size_t all_data_cb(const void *ptr, size_t size, size_t nmemb,
 	return len;
 }
 
-static size_t upload_data_cb(void *ptr, size_t size, size_t nmemb,
-			     void *user_data)
-{
-	struct upload_buffer *ub = user_data;
-	int len = size * nmemb;
-
-	if (len > ub->len)
-		len = ub->len;
-
-	if (len) {
-		memcpy(ptr, ub->buf, len);
-		ub->buf += len;
-		ub->len -= len;
-	}
-
-	return len;
-}
-
 static size_t resp_hdr_cb(void *ptr, size_t size, size_t nmemb, void *user_data)
 {
 	struct header_info *hi = user_data;
-	size_t remlen, slen, ptrlen = size * nmemb;
-	char *rem, *val = NULL, *key = NULL;
-	void *tmp;
-
-	val = calloc(1, ptrlen);
-	key = calloc(1, ptrlen);
-	if (!key || !val)
-		goto out;
-
-	tmp = memchr(ptr, ':', ptrlen);
-	if (!tmp || (tmp == ptr))	/* skip empty keys / blanks */
-		goto out;
-	slen = tmp - ptr;
-	if ((slen + 1) == ptrlen)	/* skip key w/ no value */
-		goto out;
-	memcpy(key, ptr, slen);		/* store & nul term key */
-	key[slen] = 0;
-
-	rem = ptr + slen + 1;		/* trim value's leading whitespace */
-	remlen = ptrlen - slen - 1;
-	while ((remlen > 0) && (isspace(*rem))) {
-		remlen--;
-		rem++;
-	}
-
-	memcpy(val, rem, remlen);	/* store value, trim trailing ws */
-	val[remlen] = 0;
-	while ((*val) && (isspace(val[strlen(val) - 1]))) {
-		val[strlen(val) - 1] = 0;
+	size_t keylen, vallen, ptrlen = size * nmemb;
+	const char *key = ptr, *val, *colon;
+	char rolltime[32];
+
+	colon = memchr(ptr, ':', ptrlen);
+	if (!colon || (colon == key))	/* skip empty keys / blanks */
+		return ptrlen;
+	keylen = colon - key;
+
+	val = colon + 1;		/* trim value's whitespace */
+	vallen = ptrlen - keylen - 1;
+	while (vallen && isspace(*val)) {
+		vallen--;
+		val++;
 	}
-	if (!*val)			/* skip blank value */
-		goto out;
+	while (vallen && isspace(val[vallen - 1]))
+		vallen--;
+	if (!vallen)			/* skip blank value */
+		return ptrlen;
 
 	if (opt_protocol)
-		applog(LOG_DEBUG, "HTTP hdr(%s): %s", key, val);
+		applog(LOG_DEBUG, "HTTP hdr(%.*s): %.*s", (int) keylen, key,
+		       (int) vallen, val);
 
-	if (!strcasecmp("X-Long-Polling", key)) {
-		hi->lp_path = val;	/* steal memory reference */
-		val = NULL;
+	if (keylen == 14 && !strncasecmp("X-Long-Polling", key, 14)) {
+		free(hi->lp_path);
+		hi->lp_path = strndup(val, vallen);
+	}
+
+	if (keylen == 12 && !strncasecmp("X-Roll-NTime", key, 12) &&
+	    vallen < sizeof(rolltime)) {
+		memcpy(rolltime, val, vallen);
+		rolltime[vallen] = 0;
+		if (!strncasecmp("expire=", rolltime, 7))
+			hi->rolltime = atoi(rolltime + 7);
+		else if (strcasecmp("N", rolltime) && strcmp("0", rolltime))
+			hi->rolltime = DEF_ROLLTIME;
+		if (hi->rolltime < 0)
+			hi->rolltime = 0;
 	}
 
-out:
-	free(key);
-	free(val);
 	return ptrlen;
 }
 
-json_t *json_rpc_call(CURL *curl, const char *url,
-		      const char *userpass, const char *rpc_req,
-		      bool longpoll_scan, bool longpoll)
+struct json_rpc_req {
+	CURL			*curl;
+	struct data_buffer	all_data;
+	struct curl_slist	*headers;
+	struct header_info	hi;
+	bool			lp_scanning;
+	char			curl_err_str[CURL_ERROR_SIZE];
+};
+
+/*
+ * A connection for JSON-RPC requests to 'url'. Its options, headers and
+ * buffers are set up once and kept from one request to the next.
+ */
+struct json_rpc_req *json_rpc_req_new(const char *url, const char *userpass)
 {
-	json_t *val, *err_val, *res_val;
-	int rc;
-	struct data_buffer all_data = { };
-	struct upload_buffer upload_data;
-	json_error_t err = { };
-	struct curl_slist *headers = NULL;
-	char len_hdr[64], user_agent_hdr[128];
-	char curl_err_str[CURL_ERROR_SIZE];
-	long timeout = longpoll ? (60 * 60) : (60 * 10);
-	struct header_info hi = { };
-	bool lp_scanning = false;
+	struct json_rpc_req *req;
+	char user_agent_hdr[128];
+	CURL *curl;
 
-	/* it is assumed that 'curl' is freshly [re]initialized at this pt */
+	req = calloc(1, sizeof(*req));
+	if (!req)
+		return NULL;
+	req->curl = curl = curl_easy_init();
+	if (unlikely(!curl)) {
+		applog(LOG_ERR, "CURL initialization failed");
+		free(req);
+		return NULL;
+	}
 
-	if (longpoll_scan)
-		lp_scanning = want_longpoll && !have_longpoll;
+	sprintf(user_agent_hdr, "User-Agent: %s", PACKAGE_STRING);
+	req->headers = curl_slist_append(req->headers,
+		"Content-type: application/json");
+	req->headers = curl_slist_append(req->headers, user_agent_hdr);
+	req->headers = curl_slist_append(req->headers,
+		"Expect:"); /* disable Expect hdr*/
 
 	if (opt_protocol)
 		curl_easy_setopt(curl, CURLOPT_VERBOSE, 1);
@@ -228,58 +235,84 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
 	curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1);
 	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, all_data_cb);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &all_data);
-	curl_easy_setopt(curl, CURLOPT_READFUNCTION, upload_data_cb);
-	curl_easy_setopt(curl, CURLOPT_READDATA, &upload_data);
-	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curl_err_str);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &req->all_data);
+	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, req->curl_err_str);
 	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
-	curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout);
-	if (lp_scanning) {
-		curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, resp_hdr_cb);
-		curl_easy_setopt(curl, CURLOPT_HEADERDATA, &hi);
-	}
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, resp_hdr_cb);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, &req->hi);
 	if (userpass) {
 		curl_easy_setopt(curl, CURLOPT_USERPWD, userpass);
 		curl_easy_setopt(curl, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
 	}
 	curl_easy_setopt(curl, CURLOPT_POST, 1);
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, req->headers);
+
+	return req;
+}
+
+/*
+ * Start a request on the connection, to be run by curl_easy_perform or by
+ * a multi handle. rpc_req is sent in place, it must stay around until
+ * json_rpc_req_done.
+ */
+CURL *json_rpc_req_start(struct json_rpc_req *req, const char *rpc_req,
+			 bool longpoll_scan, long timeout)
+{
+	CURL *curl = req->curl;
+
+	req->all_data.len = 0;
+	free(req->hi.lp_path);
+	memset(&req->hi, 0, sizeof(req->hi));
+	req->curl_err_str[0] = 0;
+	req->lp_scanning = longpoll_scan && want_longpoll && !have_longpoll;
 
 	if (opt_protocol)
 		applog(LOG_DEBUG, "JSON protocol request:\n%s\n", rpc_req);
 
-	upload_data.buf = rpc_req;
-	upload_data.len = strlen(rpc_req);
-	sprintf(len_hdr, "Content-Length: %lu",
-		(unsigned long) upload_data.len);
-	sprintf(user_agent_hdr, "User-Agent: %s", PACKAGE_STRING);
+	/* the length makes curl send a Content-Length, and not chunks */
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, rpc_req);
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long) strlen(rpc_req));
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout);
 
-	headers = curl_slist_append(headers,
-		"Content-type: application/json");
-	headers = curl_slist_append(headers, len_hdr);
-	headers = curl_slist_append(headers, user_agent_hdr);
-	headers = curl_slist_append(headers, "Expect:"); /* disable Expect hdr*/
+	return curl;
+}
 
-	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+/* take the reply of a request that curl finished with 'rc' */
+json_t *json_rpc_req_done(struct json_rpc_req *req, CURLcode rc,
+			  int *rolltime)
+{
+	json_t *val, *err_val, *res_val;
+	json_error_t err = { };
 
-	rc = curl_easy_perform(curl);
 	if (rc) {
-		applog(LOG_ERR, "HTTP request failed: %s", curl_err_str);
-		goto err_out;
+		applog(LOG_ERR, "HTTP request failed: %s",
+		       req->curl_err_str[0] ? req->curl_err_str :
+					      curl_easy_strerror(rc));
+		return NULL;
 	}
 
-	/* If X-Long-Polling was found, activate long polling */
-	if (hi.lp_path) {
+	if (rolltime)
+		*rolltime = req->hi.rolltime;
+
+	/*
+	 * If X-Long-Polling was found, activate long polling. Requests
+	 * started before that have the header too, only the first counts.
+	 */
+	if (req->lp_scanning && req->hi.lp_path && !have_longpoll) {
 		have_longpoll = true;
 		opt_scantime = 60;
-		tq_push(thr_info[longpoll_thr_id].q, hi.lp_path);
-	} else
-		free(hi.lp_path);
-	hi.lp_path = NULL;
+		tq_push(thr_info[longpoll_thr_id].q, req->hi.lp_path);
+		req->hi.lp_path = NULL;
+	}
 
-	val = JSON_LOADS(all_data.buf, &err);
+	if (!req->all_data.len) {
+		applog(LOG_ERR, "JSON decode failed: empty reply");
+		return NULL;
+	}
+	val = JSON_LOADS(req->all_data.buf, &err);
 	if (!val) {
 		applog(LOG_ERR, "JSON decode failed(%d): %s", err.line, err.text);
-		goto err_out;
+		return NULL;
 	}
 
 	if (opt_protocol) {
@@ -288,14 +321,13 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 		free(s);
 	}
 
-	/* JSON-RPC valid response returns a non-null 'result',
-	 * and a null 'error'.
+	/* JSON-RPC valid response returns a 'result', which is null
+	 * only for the calls with nothing to return, and a null 'error'.
 	 */
 	res_val = json_object_get(val, "result");
 	err_val = json_object_get(val, "error");
 
-	if (!res_val || json_is_null(res_val) ||
-	    (err_val && !json_is_null(err_val))) {
+	if (!res_val || (err_val && !json_is_null(err_val))) {
 		char *s;
 
 		if (err_val)
@@ -306,20 +338,34 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 		applog(LOG_ERR, "JSON-RPC call failed: %s", s);
 
 		free(s);
-
-		goto err_out;
+		json_decref(val);
+		val = NULL;
 	}
 
-	databuf_free(&all_data);
-	curl_slist_free_all(headers);
-	curl_easy_reset(curl);
 	return val;
+}
+
+void json_rpc_req_free(struct json_rpc_req *req)
+{
+	if (!req)
+		return;
+
+	curl_easy_cleanup(req->curl);
+	curl_slist_free_all(req->headers);
+	free(req->hi.lp_path);
+	databuf_free(&req->all_data);
+	free(req);
+}
 
-err_out:
-	databuf_free(&all_data);
-	curl_slist_free_all(headers);
-	curl_easy_reset(curl);
-	return NULL;
+json_t *json_rpc_call(struct json_rpc_req *req, const char *rpc_req,
+		      bool longpoll_scan, bool longpoll, int *rolltime)
+{
+	CURL *curl;
+
+	curl = json_rpc_req_start(req, rpc_req, longpoll_scan,
+				  longpoll ? (60 * 60) : (60 * 10));
+
+	return json_rpc_req_done(req, curl_easy_perform(curl), rolltime);
 }
 
 char *bin2hex(const unsigned char *p, size_t len)
@@ -365,6 +411,197 @@ bool hex2bin(unsigned char *p, const char *hexstr, size_t len)
 	return (len == 0 && *hexstr == 0) ? true : false;
 }
 
+static const char b58digits[] =
+	"123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
+
+/* Decode a Base58Check string of exactly len bytes, checksum included */
+static bool b58check_dec(unsigned char *bin, size_t len, const char *b58)
+{
+	unsigned char hash[32];
+	size_t i, j;
+
+	memset(bin, 0, len);
+	for (i = 0; b58[i]; i++) {
+		const char *d = strchr(b58digits, b58[i]);
+		unsigned int c;
+
+		if (!d)
+			return false;
+		c = d - b58digits;
+		for (j = len; j-- > 0; ) {
+			c += 58 * bin[j];
+			bin[j] = c & 0xff;
+			c >>= 8;
+		}
+		if (c)
+			return false;	/* too long */
+	}
+
+	sha256d(hash, bin, len - 4);
+	return !memcmp(hash, bin + len - 4, 4);
+}
+
+static const char bech32_charset[] = "qpzry9x8gf2tvdw0s3jn54khce6mua7l";
+
+static uint32_t bech32_polymod_step(uint32_t pre)
+{
+	uint8_t b = pre >> 25;
+
+	return ((pre & 0x1ffffff) << 5) ^
+		(-((b >> 0) & 1) & 0x3b6a57b2UL) ^
+		(-((b >> 1) & 1) & 0x26508e6dUL) ^
+		(-((b >> 2) & 1) & 0x1ea119faUL) ^
+		(-((b >> 3) & 1) & 0x3d4233ddUL) ^
+		(-((b >> 4) & 1) & 0x2a1462b3UL);
+}
+
+/*
+ * Decode a segwit address (BIP 173, BIP 350) into its witness program and
+ * its lower case human-readable part. Returns the witness version, or -1
+ * if it is not a valid address.
+ */
+static int segwit_addr_dec(unsigned char *prog, size_t *prog_len,
+			   char *hrp, size_t hrpsz, const char *addr)
+{
+	uint32_t chk = 1, acc = 0;
+	size_t len = strlen(addr), sep, i;
+	int ver = -1, bits = 0;
+	bool lower = false, upper = false;
+
+	for (sep = len; sep > 0 && addr[sep - 1] != '1'; sep--)
+		;
+	if (sep < 2 || len - sep < 7 || len > 90 || sep > hrpsz)
+		return -1;
+	sep--;
+
+	for (i = 0; i < len; i++) {
+		lower |= islower(addr[i]) != 0;
+		upper |= isupper(addr[i]) != 0;
+	}
+	if (lower && upper)
+		return -1;
+	for (i = 0; i < sep; i++)
+		hrp[i] = tolower(addr[i]);
+	hrp[sep] = 0;
+
+	for (i = 0; i < sep; i++)
+		chk = bech32_polymod_step(chk) ^ (tolower(addr[i]) >> 5);
+	chk = bech32_polymod_step(chk);
+	for (i = 0; i < sep; i++)
+		chk = bech32_polymod_step(chk) ^ (tolower(addr[i]) & 0x1f);
+
+	*prog_len = 0;
+	for (i = sep + 1; i < len; i++) {
+		const char *d = strchr(bech32_charset, tolower(addr[i]));
+		int v;
+
+		if (!d)
+			return -1;
+		v = d - bech32_charset;
+		chk = bech32_polymod_step(chk) ^ v;
+		if (i + 6 >= len)
+			continue;	/* the checksum */
+		if (i == sep + 1) {
+			ver = v;
+			continue;
+		}
+		acc = (acc << 5) | v;
+		bits += 5;
+		if (bits >= 8) {
+			bits -= 8;
+			if (*prog_len >= 40)
+				return -1;
+			prog[(*prog_len)++] = acc >> bits;
+		}
+	}
+
+	/* bech32 for version 0, bech32m after that */
+	if (chk != (ver ? 0x2bc830a3U : 1))
+		return -1;
+	if (bits >= 5 || (acc & ((1 << bits) - 1)))
+		return -1;
+	if (ver > 16 || *prog_len < 2 ||
+	    (ver == 0 && *prog_len != 20 && *prog_len != 32))
+		return -1;
+	return ver;
+}
+
+/* the address prefixes of Bitcoin and Litecoin on each chain */
+static const struct {
+	const char	*chain;		/* as getblockchaininfo reports it */
+	const char	*hrp;		/* of the segwit addresses */
+	unsigned char	p2pkh;		/* Base58Check versions */
+	unsigned char	p2sh;
+} addr_nets[] = {
+	{ "main",	"bc",	0,	5 },
+	{ "main",	"ltc",	48,	50 },
+	{ "main",	"ltc",	48,	5 },	/* the old Litecoin P2SH */
+	{ "test",	"tb",	111,	196 },
+	{ "test",	"tltc",	111,	58 },
+	{ "test",	"tltc",	111,	196 },	/* the old Litecoin P2SH */
+	{ "signet",	"tb",	111,	196 },
+	{ "regtest",	"bcrt",	111,	196 },
+	{ "regtest",	"rltc",	111,	58 },
+};
+
+/*
+ * Turn a payout address into the output script paying to it. The address
+ * must be one of 'chain', or of any chain if that is NULL. Returns the
+ * script length, or 0 if the address is not understood.
+ */
+size_t address_to_script(unsigned char *out, size_t outsz, const char *addr,
+			 const char *chain)
+{
+	unsigned char addrbin[25], prog[40];
+	size_t prog_len, i;
+	char hrp[84];
+	int ver;
+
+	ver = segwit_addr_dec(prog, &prog_len, hrp, sizeof(hrp), addr);
+	if (ver >= 0) {
+		if (outsz < prog_len + 2)
+			return 0;
+		for (i = 0; i < ARRAY_SIZE(addr_nets); i++)
+			if ((!chain || !strcmp(chain, addr_nets[i].chain)) &&
+			    !strcmp(hrp, addr_nets[i].hrp))
+				break;
+		if (i == ARRAY_SIZE(addr_nets))
+			return 0;
+		out[0] = ver ? 0x50 + ver : 0;	/* OP_n */
+		out[1] = prog_len;
+		memcpy(out + 2, prog, prog_len);
+		return prog_len + 2;
+	}
+
+	if (!b58check_dec(addrbin, sizeof(addrbin), addr) || outsz < 25)
+		return 0;
+
+	for (i = 0; i < ARRAY_SIZE(addr_nets); i++) {
+		if (chain && strcmp(chain, addr_nets[i].chain))
+			continue;
+
+		if (addrbin[0] == addr_nets[i].p2sh) {
+			out[0] = 0xa9;			/* OP_HASH160 */
+			out[1] = 0x14;
+			memcpy(out + 2, addrbin + 1, 20);
+			out[22] = 0x87;			/* OP_EQUAL */
+			return 23;
+		}
+
+		if (addrbin[0] == addr_nets[i].p2pkh) {
+			out[0] = 0x76;			/* OP_DUP */
+			out[1] = 0xa9;			/* OP_HASH160 */
+			out[2] = 0x14;
+			memcpy(out + 3, addrbin + 1, 20);
+			out[23] = 0x88;			/* OP_EQUALVERIFY */
+			out[24] = 0xac;			/* OP_CHECKSIG */
+			return 25;
+		}
+	}
+
+	return 0;
+}
+
 /* Subtract the `struct timeval' values X and Y,
    storing the result in RESULT.
    Return 1 if the difference is negative, otherwise 0.  */
@@ -394,49 +631,758 @@ timeval_subtract (
   return x->tv_sec < y->tv_sec;
 }
 
+/*
+ * Compare a hash with a target, both as 256-bit little endian numbers.
+ */
 bool fulltest(const unsigned char *hash, const unsigned char *target)
 {
 	unsigned char hash_swap[32], target_swap[32];
-	uint32_t *hash32 = (uint32_t *) hash_swap;
-	uint32_t *target32 = (uint32_t *) target_swap;
 	int i;
 	bool rc = true;
 	char *hash_str, *target_str;
 
-	swap256(hash_swap, hash);
-	swap256(target_swap, target);
-
-	for (i = 0; i < 32/4; i++) {
-		uint32_t h32tmp = swab32(hash32[i]);
-		uint32_t t32tmp = target32[i];
-
-		target32[i] = swab32(target32[i]);	/* for printing */
-
-		if (h32tmp > t32tmp) {
+	for (i = 31; i >= 0; i--) {
+		if (hash[i] > target[i]) {
 			rc = false;
 			break;
 		}
-		if (h32tmp < t32tmp) {
-			rc = true;
+		if (hash[i] < target[i])
 			break;
-		}
 	}
 
 	if (opt_debug) {
+		/* most significant byte first, for printing */
+		for (i = 0; i < 32; i++) {
+			hash_swap[i] = hash[31 - i];
+			target_swap[i] = target[31 - i];
+		}
 		hash_str = bin2hex(hash_swap, 32);
 		target_str = bin2hex(target_swap, 32);
 
 		applog(LOG_DEBUG, " Proof: %s\nTarget: %s\nTrgVal? %s",
 			hash_str,
 			target_str,
-			rc ? "YES (hash < target)" :
+			rc ? "YES (hash <= target)" :
 			     "no (false positive; hash > target)");
 
 		free(hash_str);
 		free(target_str);
 	}
 
-	return true;	/* FIXME: return rc; */
+	return rc;
+}
+
+/*
+ * Stratum is JSON-RPC with one message per line, both ways, over a plain
+ * TCP connection. curl only makes the connection, so that the name
+ * resolution and the proxy settings are the same as with getwork.
+ */
+#define STRATUM_USER_AGENT	PACKAGE_NAME "/" PACKAGE_VERSION
+#define STRATUM_RBUFSIZE	2048
+#define STRATUM_TIMEOUT		60	/* seconds */
+
+static bool socket_ready(curl_socket_t sock, bool write, int timeout)
+{
+	struct timeval tv = { timeout, 0 };
+	fd_set set;
+
+	FD_ZERO(&set);
+	FD_SET(sock, &set);
+	if (write)
+		return select(sock + 1, NULL, &set, NULL, &tv) > 0;
+	return select(sock + 1, &set, NULL, NULL, &tv) > 0;
+}
+
+static bool socket_would_block(void)
+{
+#ifdef WIN32
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+/* 's' gets the newline appended, so it needs room for one more char */
+bool stratum_send_line(struct stratum_ctx *sctx, char *s)
+{
+	size_t len, sent = 0;
+	bool rc = true;
+
+	if (opt_protocol)
+		applog(LOG_DEBUG, "> %s", s);
+
+	len = strlen(s);
+	s[len++] = '\n';
+
+	pthread_mutex_lock(&sctx->sock_lock);
+	while (sent < len) {
+		ssize_t n;
+
+		if (!sctx->curl ||
+		    !socket_ready(sctx->sock, true, STRATUM_TIMEOUT)) {
+			rc = false;
+			break;
+		}
+		n = send(sctx->sock, s + sent, len - sent, 0);
+		if (n < 0) {
+			if (socket_would_block())
+				continue;
+			rc = false;
+			break;
+		}
+		sent += n;
+	}
+	pthread_mutex_unlock(&sctx->sock_lock);
+
+	s[len - 1] = '\0';
+	if (!rc)
+		applog(LOG_ERR, "Stratum send failed");
+	return rc;
+}
+
+/* is there a line to read, or will there be one within 'timeout' seconds */
+bool stratum_socket_full(struct stratum_ctx *sctx, int timeout)
+{
+	return strchr(sctx->sockbuf, '\n') ||
+	       socket_ready(sctx->sock, false, timeout);
+}
+
+/* the next line from the server, to be freed by the caller */
+char *stratum_recv_line(struct stratum_ctx *sctx)
+{
+	time_t start = time(NULL);
+	char *nl, *line;
+	size_t len;
+
+	while (!(nl = strchr(sctx->sockbuf, '\n'))) {
+		char buf[STRATUM_RBUFSIZE];
+		ssize_t n;
+
+		if (time(NULL) - start >= STRATUM_TIMEOUT ||
+		    !socket_ready(sctx->sock, false, STRATUM_TIMEOUT)) {
+			applog(LOG_ERR, "Stratum receive timed out");
+			return NULL;
+		}
+		n = recv(sctx->sock, buf, sizeof(buf) - 1, 0);
+		if (n < 0 && socket_would_block())
+			continue;
+		if (n <= 0) {
+			applog(LOG_ERR, "Stratum connection closed");
+			return NULL;
+		}
+		buf[n] = '\0';
+
+		len = strlen(sctx->sockbuf);
+		if (len + n + 1 > sctx->sockbuf_size) {
+			size_t size = (len + n + STRATUM_RBUFSIZE) &
+				      ~(size_t)(STRATUM_RBUFSIZE - 1);
+			char *p = realloc(sctx->sockbuf, size);
+
+			if (!p)
+				return NULL;
+			sctx->sockbuf = p;
+			sctx->sockbuf_size = size;
+		}
+		memcpy(sctx->sockbuf + len, buf, n + 1);
+	}
+
+	*nl = '\0';
+	line = strdup(sctx->sockbuf);
+	memmove(sctx->sockbuf, nl + 1, strlen(nl + 1) + 1);
+
+	if (line && opt_protocol)
+		applog(LOG_DEBUG, "< %s", line);
+	return line;
+}
+
+bool stratum_connect(struct stratum_ctx *sctx, const char *url)
+{
+	CURL *curl;
+	long sock;
+	int rc;
+
+	pthread_mutex_lock(&sctx->sock_lock);
+	if (sctx->curl)
+		curl_easy_cleanup(sctx->curl);
+	sctx->curl = NULL;
+	if (!sctx->sockbuf) {
+		sctx->sockbuf = calloc(STRATUM_RBUFSIZE, 1);
+		if (!sctx->sockbuf) {
+			pthread_mutex_unlock(&sctx->sock_lock);
+			return false;
+		}
+		sctx->sockbuf_size = STRATUM_RBUFSIZE;
+	}
+	sctx->sockbuf[0] = '\0';
+
+	curl = curl_easy_init();
+	if (unlikely(!curl)) {
+		applog(LOG_ERR, "CURL initialization failed");
+		pthread_mutex_unlock(&sctx->sock_lock);
+		return false;
+	}
+
+	/* curl connects to stratum+tcp://host:port as to http://host:port */
+	if (url != sctx->url) {
+		free(sctx->url);
+		sctx->url = strdup(url);
+	}
+	free(sctx->curl_url);
+	sctx->curl_url = malloc(strlen(url) + 1);
+	if (!sctx->url || !sctx->curl_url || !strstr(url, "://")) {
+		curl_easy_cleanup(curl);
+		pthread_mutex_unlock(&sctx->sock_lock);
+		return false;
+	}
+	sprintf(sctx->curl_url, "http%s", strstr(url, "://"));
+
+	if (opt_protocol)
+		curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+	curl_easy_setopt(curl, CURLOPT_URL, sctx->curl_url);
+	curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1L);
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, (long)STRATUM_TIMEOUT);
+	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, sctx->curl_err_str);
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1L);
+	curl_easy_setopt(curl, CURLOPT_CONNECT_ONLY, 1L);
+
+	rc = curl_easy_perform(curl);
+	if (rc) {
+		applog(LOG_ERR, "Stratum connection failed: %s",
+		       sctx->curl_err_str);
+		curl_easy_cleanup(curl);
+		pthread_mutex_unlock(&sctx->sock_lock);
+		return false;
+	}
+
+#if LIBCURL_VERSION_NUM >= 0x072d00
+	{
+		curl_socket_t active;
+
+		curl_easy_getinfo(curl, CURLINFO_ACTIVESOCKET, &active);
+		sock = active;
+	}
+#else
+	curl_easy_getinfo(curl, CURLINFO_LASTSOCKET, &sock);
+#endif
+	sctx->sock = sock;
+	sctx->curl = curl;
+	pthread_mutex_unlock(&sctx->sock_lock);
+
+	return true;
+}
+
+void stratum_disconnect(struct stratum_ctx *sctx)
+{
+	pthread_mutex_lock(&sctx->sock_lock);
+	if (sctx->curl) {
+		curl_easy_cleanup(sctx->curl);
+		sctx->curl = NULL;
+		sctx->sockbuf[0] = '\0';
+	}
+	pthread_mutex_unlock(&sctx->sock_lock);
+}
+
+/*
+ * Wait for the reply to the request 'id', handling the requests of the
+ * server that come in the meantime. Late replies to earlier requests are
+ * dropped. Returns its 'result', or NULL on an error.
+ */
+static json_t *stratum_wait_reply(struct stratum_ctx *sctx, int id,
+				  json_t **val)
+{
+	json_error_t err = { };
+	json_t *res_val, *err_val, *id_val;
+	char *line;
+
+	*val = NULL;
+	while (1) {
+		line = stratum_recv_line(sctx);
+		if (!line)
+			return NULL;
+		if (stratum_handle_method(sctx, line)) {
+			free(line);
+			continue;
+		}
+
+		*val = JSON_LOADS(line, &err);
+		free(line);
+		if (!*val) {
+			applog(LOG_ERR, "JSON decode failed(%d): %s",
+			       err.line, err.text);
+			return NULL;
+		}
+
+		id_val = json_object_get(*val, "id");
+		if (json_is_integer(id_val) &&
+		    json_integer_value(id_val) == id)
+			break;
+
+		if (opt_debug)
+			applog(LOG_DEBUG, "Stratum reply to request %d "
+			       "dropped, waiting for %d",
+			       (int)json_integer_value(id_val), id);
+		json_decref(*val);
+		*val = NULL;
+	}
+
+	res_val = json_object_get(*val, "result");
+	err_val = json_object_get(*val, "error");
+	if (!res_val || json_is_null(res_val) ||
+	    (err_val && !json_is_null(err_val))) {
+		char *s = err_val ? json_dumps(err_val, JSON_INDENT(3))
+				  : strdup("(unknown reason)");
+
+		applog(LOG_ERR, "Stratum request failed: %s", s);
+		free(s);
+		return NULL;
+	}
+	return res_val;
+}
+
+bool stratum_subscribe(struct stratum_ctx *sctx)
+{
+	char *s;
+	const char *sid = NULL, *xnonce1;
+	json_t *val, *res_val, *subs;
+	size_t xnonce1_size;
+	int xn2_size, i;
+	bool rc = false;
+
+	s = malloc(128 + (sctx->session_id ? strlen(sctx->session_id) : 0));
+	if (!s)
+		return false;
+	if (sctx->session_id)
+		sprintf(s, "{\"id\": 1, \"method\": \"mining.subscribe\", "
+			"\"params\": [\"" STRATUM_USER_AGENT "\", \"%s\"]}",
+			sctx->session_id);
+	else
+		sprintf(s, "{\"id\": 1, \"method\": \"mining.subscribe\", "
+			"\"params\": [\"" STRATUM_USER_AGENT "\"]}");
+	if (!stratum_send_line(sctx, s))
+		goto out;
+
+	res_val = stratum_wait_reply(sctx, 1, &val);
+	if (!res_val) {
+		/* the session may not be resumable, start a new one */
+		free(sctx->session_id);
+		sctx->session_id = NULL;
+		goto out_val;
+	}
+
+	/* [[["mining.notify", session id], ...], extranonce1, size] */
+	subs = json_array_get(res_val, 0);
+	if (json_is_array(subs) && json_is_array(json_array_get(subs, 0)))
+		for (i = 0; i < (int)json_array_size(subs); i++) {
+			json_t *sub = json_array_get(subs, i);
+			const char *name;
+
+			name = json_string_value(json_array_get(sub, 0));
+			if (name && !strcasecmp(name, "mining.notify")) {
+				sid = json_string_value(json_array_get(sub, 1));
+				break;
+			}
+		}
+	xnonce1 = json_string_value(json_array_get(res_val, 1));
+	xn2_size = json_integer_value(json_array_get(res_val, 2));
+	if (!xnonce1 || strlen(xnonce1) % 2 || xn2_size < 1 ||
+	    xn2_size > 16) {
+		applog(LOG_ERR, "Stratum subscribe: invalid extranonces");
+		goto out_val;
+	}
+
+	xnonce1_size = strlen(xnonce1) / 2;
+	pthread_mutex_lock(&sctx->work_lock);
+	free(sctx->session_id);
+	sctx->session_id = sid ? strdup(sid) : NULL;
+	free(sctx->xnonce1);
+	sctx->xnonce1 = malloc(xnonce1_size);
+	if (sctx->xnonce1 && hex2bin(sctx->xnonce1, xnonce1, xnonce1_size)) {
+		sctx->xnonce1_size = xnonce1_size;
+		sctx->xnonce2_size = xn2_size;
+		sctx->next_diff = 1.0;
+		/* no job is valid with the new extranonce1 */
+		free(sctx->job.job_id);
+		sctx->job.job_id = NULL;
+		rc = true;
+	}
+	pthread_mutex_unlock(&sctx->work_lock);
+
+	if (rc && opt_debug)
+		applog(LOG_DEBUG, "Stratum session id: %s, extranonce1: %s, "
+		       "extranonce2 size: %d", sid ? sid : "(none)", xnonce1,
+		       xn2_size);
+
+out_val:
+	if (val)
+		json_decref(val);
+out:
+	free(s);
+	return rc;
+}
+
+bool stratum_authorize(struct stratum_ctx *sctx, const char *user,
+		       const char *pass)
+{
+	json_t *val, *res_val;
+	char *s;
+	bool rc = false;
+
+	s = malloc(80 + strlen(user) + strlen(pass));
+	if (!s)
+		return false;
+	sprintf(s, "{\"id\": 2, \"method\": \"mining.authorize\", "
+		"\"params\": [\"%s\", \"%s\"]}", user, pass);
+	if (!stratum_send_line(sctx, s))
+		goto out;
+
+	res_val = stratum_wait_reply(sctx, 2, &val);
+	if (res_val && json_is_true(res_val))
+		rc = true;
+	else
+		applog(LOG_ERR, "Stratum authentication failed");
+	if (val)
+		json_decref(val);
+
+out:
+	free(s);
+	return rc;
+}
+
+static bool is_hex(const char *s, size_t len)
+{
+	return strlen(s) == len && strspn(s, "0123456789abcdefABCDEF") == len;
+}
+
+static bool stratum_notify(struct stratum_ctx *sctx, json_t *params)
+{
+	const char *job_id, *prevhash, *coinb1, *coinb2, *version, *nbits,
+		   *ntime;
+	size_t coinb1_size, coinb2_size;
+	unsigned char **merkle = NULL;
+	json_t *merkle_arr;
+	int merkle_count, i;
+	bool clean;
+
+	job_id = json_string_value(json_array_get(params, 0));
+	prevhash = json_string_value(json_array_get(params, 1));
+	coinb1 = json_string_value(json_array_get(params, 2));
+	coinb2 = json_string_value(json_array_get(params, 3));
+	merkle_arr = json_array_get(params, 4);
+	version = json_string_value(json_array_get(params, 5));
+	nbits = json_string_value(json_array_get(params, 6));
+	ntime = json_string_value(json_array_get(params, 7));
+	clean = json_is_true(json_array_get(params, 8));
+
+	if (!job_id || !prevhash || !coinb1 || !coinb2 || !version ||
+	    !nbits || !ntime || !json_is_array(merkle_arr) ||
+	    !is_hex(prevhash, 64) || !is_hex(version, 8) ||
+	    !is_hex(nbits, 8) || !is_hex(ntime, 8) ||
+	    !is_hex(coinb1, strlen(coinb1) & ~1) ||
+	    !is_hex(coinb2, strlen(coinb2) & ~1)) {
+		applog(LOG_ERR, "Stratum notify: invalid parameters");
+		return false;
+	}
+
+	merkle_count = json_array_size(merkle_arr);
+	if (merkle_count) {
+		merkle = calloc(merkle_count, sizeof(*merkle));
+		if (!merkle)
+			return false;
+	}
+	for (i = 0; i < merkle_count; i++) {
+		const char *s = json_string_value(json_array_get(merkle_arr, i));
+
+		merkle[i] = malloc(32);
+		if (!s || !merkle[i] || !is_hex(s, 64)) {
+			applog(LOG_ERR, "Stratum notify: invalid merkle branch");
+			for (; i >= 0; i--)
+				free(merkle[i]);
+			free(merkle);
+			return false;
+		}
+		hex2bin(merkle[i], s, 32);
+	}
+
+	pthread_mutex_lock(&sctx->work_lock);
+
+	/* coinb1 extranonce1 extranonce2 coinb2 */
+	coinb1_size = strlen(coinb1) / 2;
+	coinb2_size = strlen(coinb2) / 2;
+	sctx->job.coinbase_size = coinb1_size + sctx->xnonce1_size +
+				  sctx->xnonce2_size + coinb2_size;
+	sctx->job.coinbase = realloc(sctx->job.coinbase,
+				     sctx->job.coinbase_size);
+	if (!sctx->job.coinbase) {
+		pthread_mutex_unlock(&sctx->work_lock);
+		return false;
+	}
+	sctx->job.xnonce2 = sctx->job.coinbase + coinb1_size +
+			    sctx->xnonce1_size;
+	hex2bin(sctx->job.coinbase, coinb1, coinb1_size);
+	memcpy(sctx->job.coinbase + coinb1_size, sctx->xnonce1,
+	       sctx->xnonce1_size);
+	memset(sctx->job.xnonce2, 0, sctx->xnonce2_size);
+	hex2bin(sctx->job.xnonce2 + sctx->xnonce2_size, coinb2, coinb2_size);
+
+	free(sctx->job.job_id);
+	sctx->job.job_id = strdup(job_id);
+	hex2bin(sctx->job.prevhash, prevhash, 32);
+
+	for (i = 0; i < sctx->job.merkle_count; i++)
+		free(sctx->job.merkle[i]);
+	free(sctx->job.merkle);
+	sctx->job.merkle = merkle;
+	sctx->job.merkle_count = merkle_count;
+
+	hex2bin(sctx->job.version, version, 4);
+	hex2bin(sctx->job.nbits, nbits, 4);
+	hex2bin(sctx->job.ntime, ntime, 4);
+	sctx->job.clean = clean;
+	sctx->job.diff = sctx->next_diff;
+
+	pthread_mutex_unlock(&sctx->work_lock);
+
+	return true;
+}
+
+static bool stratum_set_difficulty(struct stratum_ctx *sctx, json_t *params)
+{
+	json_t *diff_val = json_array_get(params, 0);
+	double diff;
+
+	if (json_is_integer(diff_val))
+		diff = json_integer_value(diff_val);
+	else
+		diff = json_real_value(diff_val);
+	if (diff <= 0)
+		return false;
+
+	/* it applies from the next job on */
+	pthread_mutex_lock(&sctx->work_lock);
+	sctx->next_diff = diff;
+	pthread_mutex_unlock(&sctx->work_lock);
+
+	applog(LOG_INFO, "Stratum difficulty set to %g", diff);
+
+	return true;
+}
+
+static bool stratum_reconnect(struct stratum_ctx *sctx, json_t *params)
+{
+	const char *host = json_string_value(json_array_get(params, 0));
+	json_t *port_val = json_array_get(params, 1);
+	char port[16], *url;
+
+	if (json_is_string(port_val))
+		snprintf(port, sizeof(port), "%s", json_string_value(port_val));
+	else if (json_is_integer(port_val))
+		snprintf(port, sizeof(port), "%d",
+			 (int)json_integer_value(port_val));
+	else
+		return false;
+	if (!host)
+		return false;
+
+	url = malloc(32 + strlen(host) + strlen(port));
+	if (!url)
+		return false;
+	sprintf(url, "stratum+tcp://%s:%s", host, port);
+
+	free(sctx->url);
+	sctx->url = url;
+	stratum_disconnect(sctx);
+
+	applog(LOG_INFO, "Stratum server asked to reconnect to %s", url);
+
+	return true;
+}
+
+static bool stratum_reply(struct stratum_ctx *sctx, json_t *id,
+			  const char *result)
+{
+	char s[160];
+
+	if (!json_is_integer(id))
+		return true;	/* a notification, nothing to answer */
+	snprintf(s, sizeof(s) - 1,
+		 "{\"id\": %d, \"result\": %s, \"error\": null}",
+		 (int)json_integer_value(id), result);
+	return stratum_send_line(sctx, s);
+}
+
+/*
+ * Handle a request or a notification from the server. Returns false if the
+ * line is something else, like the reply to one of our requests.
+ */
+bool stratum_handle_method(struct stratum_ctx *sctx, const char *s)
+{
+	json_error_t err = { };
+	json_t *val, *id, *params;
+	const char *method;
+	bool rc = false;
+
+	val = JSON_LOADS(s, &err);
+	if (!val) {
+		applog(LOG_ERR, "JSON decode failed(%d): %s", err.line, err.text);
+		return false;
+	}
+
+	method = json_string_value(json_object_get(val, "method"));
+	if (!method)
+		goto out;
+	id = json_object_get(val, "id");
+	params = json_object_get(val, "params");
+
+	rc = true;
+	if (!strcasecmp(method, "mining.notify"))
+		stratum_notify(sctx, params);
+	else if (!strcasecmp(method, "mining.set_difficulty"))
+		stratum_set_difficulty(sctx, params);
+	else if (!strcasecmp(method, "client.reconnect"))
+		stratum_reconnect(sctx, params);
+	else if (!strcasecmp(method, "client.get_version"))
+		stratum_reply(sctx, id, "\"" STRATUM_USER_AGENT "\"");
+	else if (!strcasecmp(method, "client.show_message")) {
+		const char *msg = json_string_value(json_array_get(params, 0));
+
+		applog(LOG_INFO, "Pool message: %s", msg ? msg : "");
+		stratum_reply(sctx, id, "true");
+	} else {
+		applog(LOG_WARNING, "Unknown Stratum method '%s'", method);
+		if (json_is_integer(id)) {
+			char r[160];
+
+			snprintf(r, sizeof(r) - 1, "{\"id\": %d, \"result\": "
+				 "null, \"error\": [-3, \"Method not found\", "
+				 "null]}", (int)json_integer_value(id));
+			stratum_send_line(sctx, r);
+		}
+	}
+
+out:
+	json_decref(val);
+	return rc;
+}
+
+#define HUGE_PAGE_SIZE	(2 * 1024 * 1024)
+
+#if defined(HAVE_SYS_MMAN_H) && defined(MADV_HUGEPAGE) && defined(__linux)
+/*
+ * Check if the mapping holding the buffer did end up in transparent huge
+ * pages. Returns the fraction of it which did.
+ */
+static double thp_fraction(const void *buf)
+{
+	char line[256];
+	unsigned long start, end;
+	size_t kb = 0, size = 0;
+	FILE *f;
+
+	f = fopen("/proc/self/smaps", "r");
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (!size) {
+			if (sscanf(line, "%lx-%lx ", &start, &end) == 2 &&
+			    start <= (uintptr_t)buf && (uintptr_t)buf < end)
+				size = end - start;
+			continue;
+		}
+		if (sscanf(line, "AnonHugePages: %zu kB", &kb) == 1)
+			break;
+	}
+	fclose(f);
+	return size ? kb * 1024.0 / size : 0;
+}
+#endif
+
+/*
+ * Allocate a scrypt scratchpad. Random accesses all over it cause a lot
+ * of TLB misses with 4 KiB pages, so explicit huge pages are tried first
+ * and transparent huge pages next. The buffer is faulted in right away,
+ * so that this does not happen during the first hashes, and optionally
+ * locked in memory.
+ */
+bool scratchbuf_alloc(struct scratchbuf *sb, size_t size, bool huge, bool lock)
+{
+	size_t i;
+
+	memset(sb, 0, sizeof(*sb));
+
+#ifdef HAVE_SYS_MMAN_H
+	sb->size = (size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+
+#ifdef MAP_HUGETLB
+	if (huge) {
+		sb->buf = mmap(NULL, sb->size, PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+			       -1, 0);
+		if (sb->buf == MAP_FAILED)
+			sb->buf = NULL;
+		else
+			sb->backing = "2 MiB huge pages";
+	}
+#endif
+
+	if (!sb->buf) {
+		unsigned char *p;
+		size_t head;
+
+		/* over-allocate to align the buffer at a huge page boundary */
+		p = mmap(NULL, sb->size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			return false;
+		head = -(uintptr_t)p & (HUGE_PAGE_SIZE - 1);
+		if (head)
+			munmap(p, head);
+		munmap(p + head + sb->size, HUGE_PAGE_SIZE - head);
+		sb->buf = p + head;
+		sb->backing = "4 KiB pages";
+#ifdef MADV_HUGEPAGE
+		if (huge)
+			madvise(sb->buf, sb->size, MADV_HUGEPAGE);
+#endif
+	}
+
+	if (lock)
+		sb->locked = !mlock(sb->buf, sb->size);
+#else
+	sb->size = size;
+	sb->buf = malloc(size);
+	if (!sb->buf)
+		return false;
+	sb->backing = "malloc";
+#endif
+
+	/* fault it in now */
+	for (i = 0; i < sb->size; i += 4096)
+		sb->buf[i] = 0;
+
+#if defined(HAVE_SYS_MMAN_H) && defined(MADV_HUGEPAGE) && defined(__linux)
+	if (huge && !strcmp(sb->backing, "4 KiB pages")) {
+		double thp = thp_fraction(sb->buf);
+		if (thp >= 1)
+			sb->backing = "transparent huge pages";
+		else if (thp > 0)
+			sb->backing = "partially transparent huge pages";
+	}
+#endif
+
+	return true;
+}
+
+void scratchbuf_free(struct scratchbuf *sb)
+{
+	if (!sb->buf)
+		return;
+#ifdef HAVE_SYS_MMAN_H
+	munmap(sb->buf, sb->size);
+#else
+	free(sb->buf);
+#endif
+	sb->buf = NULL;
 }
 
 struct thread_q *tq_new(void)